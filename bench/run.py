@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""Lox benchmark harness.
+
+Runs every bench/*.lox program N times under one or more lox binaries and
+reports median / p10 / p90 wall time, peak vm->bytesAllocated, GC count and
+(when available) instruction counts. The first binary is the baseline; the
+others are reported as a ratio against it.
+
+    # build two variants from the source tree and compare them
+    python3 bench/run.py --build nan --build tagged=-DNO_NAN_BOXING -n 10
+
+    # compare two existing binaries, write machine readable results
+    python3 bench/run.py --lox old=/tmp/lox_old --lox new=./lox --json out.json
+
+Binaries must be built with -DNDEBUG, otherwise the VM traces every
+instruction. --build does this automatically.
+"""
+
+import argparse
+import glob
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+FORMAT_VERSION = 1
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+STATS_RE = re.compile(r"stats: (\d+) peak bytes, (\d+) collections")
+OPCODES_RE = re.compile(r"opcodes: (\d+) executed")
+
+
+def build(name, cflags, out_dir):
+    path = os.path.join(out_dir, "lox-" + name)
+    sources = sorted(glob.glob(os.path.join(ROOT_DIR, "*.c")))
+    cmd = ["gcc", "-O2", "-DNDEBUG"] + cflags.split() + ["-o", path] + sources + ["-lpthread"]
+    print("building %s: %s" % (name, " ".join(["gcc", "-O2", "-DNDEBUG"] + cflags.split())), file=sys.stderr)
+    subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+    return path
+
+
+def percentile(values, p):
+    values = sorted(values)
+    k = (len(values) - 1) * p
+    low = int(k)
+    high = min(low + 1, len(values) - 1)
+    return values[low] + (values[high] - values[low]) * (k - low)
+
+
+def run_once(binary, vm_args, script, use_perf):
+    cmd = [binary, "--stats"] + vm_args + [script]
+    if use_perf:
+        cmd = ["perf", "stat", "-x,", "-e", "instructions:u"] + cmd
+    start = time.perf_counter()
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    elapsed = time.perf_counter() - start
+
+    result = {"time": elapsed, "status": proc.returncode,
+              "stdout": "\n".join(l for l in proc.stdout.splitlines() if not l.startswith("======== run:"))}
+    match = STATS_RE.search(proc.stderr)
+    if match:
+        result["peak_bytes"] = int(match.group(1))
+        result["collections"] = int(match.group(2))
+    match = OPCODES_RE.search(proc.stderr)
+    if match:
+        result["bytecodes"] = int(match.group(1))
+    if use_perf:
+        for line in proc.stderr.splitlines():
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("instructions") and fields[0].isdigit():
+                result["instructions"] = int(fields[0])
+    return result
+
+
+def bench(binary, vm_args, script, runs, warmup, use_perf):
+    for _ in range(warmup):
+        run_once(binary, vm_args, script, False)
+    samples = [run_once(binary, vm_args, script, use_perf) for _ in range(runs)]
+    times = [s["time"] for s in samples]
+    first = samples[0]
+    summary = {
+        "runs": runs,
+        "median_s": statistics.median(times),
+        "p10_s": percentile(times, 0.10),
+        "p90_s": percentile(times, 0.90),
+        "min_s": min(times),
+        "max_s": max(times),
+        "status": first["status"],
+        "stdout": first["stdout"],
+    }
+    for key in ("peak_bytes", "collections", "bytecodes", "instructions"):
+        if key in first:
+            summary[key] = statistics.median(s[key] for s in samples if key in s)
+    return summary
+
+
+def human_bytes(n):
+    if n < 1024 * 1024:
+        return "%.1fKB" % (n / 1024.0)
+    return "%.1fMB" % (n / (1024.0 * 1024.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--lox", action="append", default=[], metavar="NAME=PATH",
+                        help="an existing binary to benchmark (repeatable)")
+    parser.add_argument("--build", action="append", default=[], metavar="NAME[=CFLAGS]",
+                        help="build a variant from the source tree with extra CFLAGS (repeatable)")
+    parser.add_argument("-n", "--runs", type=int, default=5, help="timed runs per benchmark")
+    parser.add_argument("--warmup", type=int, default=1, help="untimed runs per benchmark")
+    parser.add_argument("--filter", default="", help="only run benchmarks whose name contains this")
+    parser.add_argument("--vm-args", default="", help="extra arguments passed to every binary, e.g. --jit")
+    parser.add_argument("--perf", action="store_true", help="count user-space instructions with perf stat")
+    parser.add_argument("--json", metavar="FILE", help="write results as JSON ('-' for stdout)")
+    args = parser.parse_args()
+
+    scripts = sorted(glob.glob(os.path.join(BENCH_DIR, "*.lox")))
+    scripts = [s for s in scripts if args.filter in os.path.basename(s)]
+    if not scripts:
+        parser.error("no benchmarks match")
+    if args.perf and shutil.which("perf") is None:
+        parser.error("perf not found")
+
+    build_dir = tempfile.mkdtemp(prefix="loxbench-")
+    binaries = []
+    cflags_of = {}
+    try:
+        for spec in args.build:
+            name, _, cflags = spec.partition("=")
+            binaries.append((name, build(name, cflags, build_dir)))
+            cflags_of[name] = cflags
+        for spec in args.lox:
+            name, sep, path = spec.partition("=")
+            binaries.append((name, path) if sep else (os.path.basename(name), name))
+        if not binaries:
+            binaries.append(("default", build("default", "", build_dir)))
+            cflags_of["default"] = ""
+
+        vm_args = args.vm_args.split()
+        results = []
+        for script in scripts:
+            name = os.path.splitext(os.path.basename(script))[0]
+            baseline = None
+            for label, binary in binaries:
+                summary = bench(binary, vm_args, script, args.runs, args.warmup, args.perf)
+                summary.update({"benchmark": name, "binary": label})
+                if baseline is None:
+                    baseline = summary
+                else:
+                    summary["ratio"] = summary["median_s"] / baseline["median_s"]
+                    summary["output_matches"] = summary["stdout"] == baseline["stdout"]
+                results.append(summary)
+                print_row(summary, sys.stderr if args.json == "-" else sys.stdout)
+    finally:
+        shutil.rmtree(build_dir, ignore_errors=True)
+
+    failed = [r for r in results if r["status"] != 0 or not r.get("output_matches", True)]
+    for r in failed:
+        print("warning: %s/%s exited %d%s" % (r["benchmark"], r["binary"], r["status"],
+              "" if r.get("output_matches", True) else " with different output"), file=sys.stderr)
+
+    if args.json:
+        for r in results:
+            del r["stdout"]
+        document = {"version": FORMAT_VERSION, "runs": args.runs, "vm_args": vm_args,
+                    "binaries": [{"name": n, "cflags": cflags_of[n]} if n in cflags_of else {"name": n, "path": p}
+                                 for n, p in binaries], "results": results}
+        if args.json == "-":
+            json.dump(document, sys.stdout, indent=2)
+            print()
+        else:
+            with open(args.json, "w") as fp:
+                json.dump(document, fp, indent=2)
+    return 1 if failed else 0
+
+
+_header_printed = False
+
+
+def print_row(r, out):
+    global _header_printed
+    if not _header_printed:
+        print("%-14s %-10s %9s %9s %9s %10s %5s %14s %7s" % (
+            "benchmark", "binary", "median", "p10", "p90", "peak", "gc", "instructions", "ratio"), file=out)
+        _header_printed = True
+    count = r.get("instructions", r.get("bytecodes"))
+    print("%-14s %-10s %8.3fs %8.3fs %8.3fs %10s %5s %14s %7s" % (
+        r["benchmark"], r["binary"], r["median_s"], r["p10_s"], r["p90_s"],
+        human_bytes(r["peak_bytes"]) if "peak_bytes" in r else "-",
+        "%d" % r["collections"] if "collections" in r else "-",
+        "%d" % count if count is not None else "-",
+        "%.2fx" % r["ratio"] if "ratio" in r else ""), file=out)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -2,42 +2,137 @@
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
+#include "obj_function.h"
 
 void init_chunk(Chunk *chunk)
 {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
+    chunk->mapped = false;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
 }
 
-void write_chunk(Chunk *chunk, uint8_t byte, int line)
+void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count+1) {
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count-1].line == line)
+        return;
+    if (chunk->line_capacity < chunk->line_count+1) {
+        int old_capacity = chunk->line_capacity;
+        chunk->line_capacity = GROW_CAPACITY(old_capacity);
+        chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, old_capacity, chunk->line_capacity);
+    }
+    chunk->lines[chunk->line_count].offset = chunk->count-1;
+    chunk->lines[chunk->line_count].line = line;
+    chunk->line_count++;
+}
+
+int get_line(Chunk *chunk, int offset)
+{
+    int low = 0, high = chunk->line_count-1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (chunk->lines[mid].offset <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return chunk->line_count > 0 ? chunk->lines[low].line : 0;
 }
 
-int add_constant(Chunk *chunk, Value value)
+int add_constant(VM *vm, Chunk *chunk, Value value)
 {
-    push(value);
-    write_value_array(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    write_value_array(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count-1;
 }
 
-void free_chunk(Chunk *chunk)
+int add_inline_cache(VM *vm, Chunk *chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count+1) {
+        int old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    InlineCache *cache = &chunk->caches[chunk->cache_count];
+    for (int i=0; i<INLINE_CACHE_WAYS; i++) {
+        cache->entries[i].klass = NULL;
+        cache->entries[i].version = 0;
+        cache->entries[i].shape = NULL;
+        cache->entries[i].transition = NULL;
+        cache->entries[i].index = -1;
+        cache->entries[i].method = NIL_VAL;
+    }
+    return chunk->cache_count++;
+}
+
+int instruction_length(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset+1]]);
+            return 2 + function->upvalueCount*2;
+        }
+        case OP_ADD_LOCAL_LOCAL:
+            return 5;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 9;
+        case OP_GET_PROPERTY_SET_LOCAL:
+            return 6;
+        default:
+            return 1;
+    }
+}
+
+void free_chunk(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    free_value_array(&chunk->constants);
+    if (!chunk->mapped) {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, LineStart, chunk->lines, chunk->line_capacity);
+    }
+    free_value_array(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cache_capacity);
     init_chunk(chunk);
 }
 
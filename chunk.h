@@ -6,21 +6,57 @@
 #include "value_array.h"
 
 
+#define INLINE_CACHE_WAYS       (4)
+
+struct ObjClass;
+struct ObjShape;
+
+typedef struct {
+    struct ObjClass *klass;
+    int version;
+    struct ObjShape *shape;
+    struct ObjShape *transition;
+    int index;
+    Value method;
+}CacheEntry;
+
+typedef struct {
+    CacheEntry entries[INLINE_CACHE_WAYS];
+}InlineCache;
+
+// 行号按游程编码, 只记录每一行第一条字节码的偏移
+typedef struct {
+    int offset;
+    int line;
+}LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int line_count;
+    int line_capacity;
+    LineStart *lines;
+    bool mapped;        // code和lines指向映射的镜像, 不归chunk所有
     ValueArray constants;
+    int cache_count;
+    int cache_capacity;
+    InlineCache *caches;
 }Chunk;
 
 void init_chunk(Chunk *chunk);
 
-void write_chunk(Chunk *chunk, uint8_t byte, int line);
+void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+
+int add_constant(VM *vm, Chunk *chunk, Value value);
+
+int add_inline_cache(VM *vm, Chunk *chunk);
+
+int instruction_length(Chunk *chunk, int offset);
 
-int add_constant(Chunk *chunk, Value value);
+int get_line(Chunk *chunk, int offset);
 
-void free_chunk(Chunk *chunk);
+void free_chunk(VM *vm, Chunk *chunk);
 
 #endif
 
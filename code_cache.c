@@ -0,0 +1,92 @@
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "code_cache.h"
+#include "serialize.h"
+
+// 缓存文件名由源码的FNV-1a哈希, 源码长度和LOXC_VERSION组成,
+// 源码或字节码格式变化后自然落到新的文件上.
+static uint64_t hash_source(const char *source, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool cache_dir(char *path, size_t size)
+{
+    const char *dir = getenv("LOX_CACHE_DIR");
+    int n;
+    if (dir != NULL && dir[0] != '\0')
+        n = snprintf(path, size, "%s", dir);
+    else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0')
+        n = snprintf(path, size, "%s/lox", dir);
+    else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0')
+        n = snprintf(path, size, "%s/.cache/lox", dir);
+    else
+        return false;
+    return n > 0 && (size_t)n < size;
+}
+
+// 逐级创建目录, 已存在不算错误
+static bool make_dirs(char *path)
+{
+    for (char *p = path + 1; ; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+        *p = c;
+        if (!ok) return false;
+        if (c == '\0') return true;
+    }
+}
+
+bool code_cache_path(char *path, size_t size, const char *source, size_t length)
+{
+    if (!cache_dir(path, size))
+        return false;
+    size_t dir = strlen(path);
+    int n = snprintf(path + dir, size - dir, "/%016llx-%zx-v%d.loxc",
+                     (unsigned long long)hash_source(source, length), length, LOXC_VERSION);
+    return n > 0 && (size_t)n < size - dir;
+}
+
+ObjFunction *load_code_cache(VM *vm, const char *path)
+{
+    Image *image = open_image(path);
+    return image != NULL ? load_image(vm, image) : NULL;
+}
+
+// 先写到同目录下的临时文件再rename, 其他进程要么看不到缓存, 要么看到完整的文件.
+// 写缓存失败只是少一次加速, 不报错.
+void save_code_cache(VM *vm, ObjFunction *function, const char *path)
+{
+    char tmp[CODE_CACHE_PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || (size_t)(slash - path) + 1 >= sizeof(tmp)) return;
+    memcpy(tmp, path, slash - path);
+    tmp[slash - path] = '\0';
+    if (!make_dirs(tmp)) return;
+    int n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if (n <= 0 || (size_t)n >= sizeof(tmp)) return;
+
+    int fd = mkstemp(tmp);
+    if (fd < 0) return;
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    bool ok = save_bytecode(vm, function, fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
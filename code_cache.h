@@ -0,0 +1,18 @@
+
+#ifndef _CODE_CACHE_H_
+#define _CODE_CACHE_H_
+
+#include "common.h"
+#include "obj_function.h"
+
+// 缓存目录: $LOX_CACHE_DIR, 否则$XDG_CACHE_HOME/lox, 否则$HOME/.cache/lox
+#define CODE_CACHE_PATH_MAX (4096)
+
+bool code_cache_path(char *path, size_t size, const char *source, size_t length);
+
+ObjFunction *load_code_cache(VM *vm, const char *path);
+
+void save_code_cache(VM *vm, ObjFunction *function, const char *path);
+
+#endif
+
@@ -11,15 +11,33 @@
 #include <stdarg.h>
 #include <time.h>
 
+// 用-DNDEBUG编译发布版本(跑benchmark时需要)
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// 统计每个opcode的执行次数和相邻组合, 退出时输出报告
+// #define DEBUG_OPCODE_STATS
+// 同时用rdtsc统计每个opcode的周期数
+// #define DEBUG_OPCODE_CYCLES
+
+#ifndef NO_NAN_BOXING
 #define NAN_BOXING
+#endif
+
+// #define NO_COMPUTED_GOTO
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #define UINT8_COUNT                 (UINT8_MAX + 1)
 
+typedef struct VM VM;
+
 #endif
 
@@ -4,13 +4,19 @@
 #include "debug.h"
 #include "obj_function.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
 
 typedef struct {
+    VM *vm;
+    Scanner scanner;
     Token current;
     Token previous;
     bool scan_error;
     bool parse_error;
     bool need_sync;
+    struct Compiler *compiler;
+    struct ClassCompiler *klass;
 }Parser;
 
 typedef enum {
@@ -27,7 +33,7 @@ typedef enum {
     PREC_PRIMARY,
 }Precedence;
 
-typedef void (*ParseFunc)(bool can_assign);
+typedef void (*ParseFunc)(Parser *parser, bool can_assign);
 typedef struct {
     ParseFunc prefix;
     ParseFunc infix;
@@ -60,46 +66,47 @@ typedef struct Compiler {
     int local_count;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    int last_call;
 }Compiler;
 
-static Parser parser;
-static Compiler *current = NULL;
-static Chunk *compiling_chunk;
-
-static Scanner scanner;
-
 typedef struct ClassCompiler {
   struct ClassCompiler* enclosing;
   bool hasSuperclass;
 } ClassCompiler;
-ClassCompiler* currentClass = NULL;
 
-static Chunk *current_chunk()
+static Chunk *current_chunk(Parser *parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
-static void init_parser()
+static void init_parser(Parser *parser, VM *vm, const char *source)
 {
-    parser.scan_error = false;
-    parser.parse_error = false;
-    parser.need_sync = false;
+    parser->vm = vm;
+    init_scanner(&parser->scanner, source);
+    parser->compiler = NULL;
+    parser->klass = NULL;
+    parser->scan_error = false;
+    parser->parse_error = false;
+    parser->need_sync = false;
 }
 
-static void init_compiler(Compiler *compiler, FunctionType type)
+static void init_compiler(Parser *parser, Compiler *compiler, FunctionType type)
 {
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
-    current = compiler;
+    compiler->last_call = -1;
+    compiler->function = new_function(parser->vm);
+    parser->compiler = compiler;
+    parser->vm->compiler = compiler;
     if (type != TYPE_SCRIPT) {
-    current->function->name = copy_string(parser.previous.start,
-                                         parser.previous.length);
+    parser->compiler->function->name = copy_string(parser->vm, parser->previous.start,
+                                         parser->previous.length);
+    WRITE_BARRIER_OBJ(parser->vm, parser->compiler->function, parser->compiler->function->name);
   }
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     if (type != TYPE_FUNCTION) {
     local->name.start = "this";
@@ -110,209 +117,231 @@ static void init_compiler(Compiler *compiler, FunctionType type)
   }
     local->isCaptured = false;
 }
-static void emit_return();
-static ObjFunction *end()
+static void emit_return(Parser *parser);
+static ObjFunction *end(Parser *parser)
 {
-    emit_return();
+    emit_return(parser);
+    optimize_chunk(current_chunk(parser));
 
-    ObjFunction *function = current->function;
+    ObjFunction *function = parser->compiler->function;
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.scan_error && !parser.parse_error)
-        disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (!parser->scan_error && !parser->parse_error)
+        disassemble_chunk(parser->vm, current_chunk(parser), function->name != NULL ? function->name->chars : "<script>");
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
+    parser->vm->compiler = parser->compiler;
     return function;
 }
 
 
-static void parse_error(Token token, const char *message)
+static void parse_error(Parser *parser, Token token, const char *message)
 {
-    parser.parse_error = true;
-    parser.need_sync = true;
-    printf("[Line %d] parse error at '%.*s', %s\n", token.line, token.length, token.start, message);
+    parser->parse_error = true;
+    parser->need_sync = true;
+    fprintf(parser->vm->out, "[Line %d] parse error at '%.*s', %s\n", token.line, token.length, token.start, message);
 }
 
-static void advance()
+static void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
     while (1) {
-        parser.current = scan_token(&scanner);
-        if (parser.current.type != TOKEN_ERROR_UNEXPECTED_CHARACTER
-            && parser.current.type != TOKEN_ERROR_UNTERMINATED_STRING) return;
-        parser.scan_error = true;
-        if (parser.current.type == TOKEN_ERROR_UNEXPECTED_CHARACTER)
-            printf("[Line %d] scan error at '%.*s', unexpected character.\n", parser.current.line, parser.current.length, parser.current.start);
-        else if (parser.current.type == TOKEN_ERROR_UNTERMINATED_STRING)
-            printf("[Line %d] scan error at '%.*s', unterminated string.\n", parser.current.line, parser.current.length, parser.current.start);
+        parser->current = scan_token(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR_UNEXPECTED_CHARACTER
+            && parser->current.type != TOKEN_ERROR_UNTERMINATED_STRING) return;
+        parser->scan_error = true;
+        if (parser->current.type == TOKEN_ERROR_UNEXPECTED_CHARACTER)
+            fprintf(parser->vm->out, "[Line %d] scan error at '%.*s', unexpected character.\n", parser->current.line, parser->current.length, parser->current.start);
+        else if (parser->current.type == TOKEN_ERROR_UNTERMINATED_STRING)
+            fprintf(parser->vm->out, "[Line %d] scan error at '%.*s', unterminated string.\n", parser->current.line, parser->current.length, parser->current.start);
     }
 }
 
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-    if (parser.current.type != type) return false;
-    advance();
+    if (parser->current.type != type) return false;
+    advance(parser);
     return true;
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type != type) {
-        parse_error(parser.current, message);
+    if (parser->current.type != type) {
+        parse_error(parser, parser->current, message);
         return;
     }
-    advance();
+    advance(parser);
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_byte(Parser *parser, uint8_t byte)
 {
-    write_chunk(current_chunk(), byte, parser.previous.line);
+    write_chunk(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
-static void emit_byte2(uint8_t byte1, uint8_t byte2)
+static void emit_byte2(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-    emit_byte(byte1);
-    emit_byte(byte2);
+    emit_byte(parser, byte1);
+    emit_byte(parser, byte2);
 }
 
-static int emit_jump(uint8_t byte)
+static int emit_jump(Parser *parser, uint8_t byte)
 {
-    emit_byte(byte);
-    emit_byte(0xff);
-    emit_byte(0xff);
-    return current_chunk()->count - 2;
+    emit_byte(parser, byte);
+    emit_byte(parser, 0xff);
+    emit_byte(parser, 0xff);
+    return current_chunk(parser)->count - 2;
 }
 
-static void patch_jump(int offset)
+static void patch_jump(Parser *parser, int offset)
 {
-    int jump = current_chunk()->count - offset - 2;
-    if (jump > UINT16_MAX) parse_error(parser.previous, "Too much code to jump over.");
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset+1] = jump & 0xff;
+    int jump = current_chunk(parser)->count - offset - 2;
+    if (jump > UINT16_MAX) parse_error(parser, parser->previous, "Too much code to jump over.");
+    current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    current_chunk(parser)->code[offset+1] = jump & 0xff;
 }
 
-static void emit_loop(int loop)
+static void emit_loop(Parser *parser, int loop)
 {
-    emit_byte(OP_LOOP);
-    int offset = current_chunk()->count - loop + 2;
-    if (offset > UINT16_MAX) parse_error(parser.previous, "Loop body too large.");
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_byte(parser, OP_LOOP);
+    int offset = current_chunk(parser)->count - loop + 2;
+    if (offset > UINT16_MAX) parse_error(parser, parser->previous, "Loop body too large.");
+    emit_byte(parser, (offset >> 8) & 0xff);
+    emit_byte(parser, offset & 0xff);
 }
 
-static void emit_return()
+static void emit_return(Parser *parser)
 {
-    if (current->type == TYPE_INITIALIZER) {
-    emit_byte2(OP_GET_LOCAL, 0);
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+    emit_byte2(parser, OP_GET_LOCAL, 0);
   } else {
-    emit_byte(OP_NIL);
+    emit_byte(parser, OP_NIL);
   }
-    emit_byte(OP_RETURN);
+    emit_byte(parser, OP_RETURN);
 }
 
-static uint8_t make_constant(Value value)
+static void emit_inline_cache(Parser *parser)
 {
-    int index = add_constant(current_chunk(), value);
+    SNAPSHOT_BARRIER(parser->vm, parser->compiler->function);
+    int index = add_inline_cache(parser->vm, current_chunk(parser));
+    if (index > UINT16_MAX) parse_error(parser, parser->previous, "Too many property accesses in one chunk.");
+    emit_byte2(parser, (index >> 8) & 0xff, index & 0xff);
+}
+
+static uint8_t make_constant(Parser *parser, Value value)
+{
+    SNAPSHOT_BARRIER(parser->vm, parser->compiler->function);
+    int index = add_constant(parser->vm, current_chunk(parser), value);
+    WRITE_BARRIER(parser->vm, parser->compiler->function, value);
     if (index > 255) {
-        parse_error(parser.previous, "Too many constants in one chunk.");
+        parse_error(parser, parser->previous, "Too many constants in one chunk.");
         return 0;
     }
     return index;
 }
 
-static void emit_constant(Value value)
+static void emit_constant(Parser *parser, Value value)
 {
-    emit_byte2(OP_CONSTANT, make_constant(value));
+    emit_byte2(parser, OP_CONSTANT, make_constant(parser, value));
 }
 
 static ParseRule *get_rule(TokenType type);
-static void parse_precedence(Precedence precedence);
-static void expression();
-static void statement();
-static void var_declaration();
-static void declaration();
+static void parse_precedence(Parser *parser, Precedence precedence);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void var_declaration(Parser *parser);
+static void declaration(Parser *parser);
 
-static void unary(bool can_assign)
+static void unary(Parser *parser, bool can_assign)
 {
-    TokenType type = parser.previous.type;
-    parse_precedence(PREC_UNARY);
+    TokenType type = parser->previous.type;
+    parse_precedence(parser, PREC_UNARY);
     switch (type) {
-        case TOKEN_BANG: emit_byte(OP_NOT); break;
-        case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+        case TOKEN_BANG: emit_byte(parser, OP_NOT); break;
+        case TOKEN_MINUS: emit_byte(parser, OP_NEGATE); break;
         default: break;
     }
 }
 
-static void binary(bool can_assign)
+static void binary(Parser *parser, bool can_assign)
 {
-    TokenType type = parser.previous.type;
+    TokenType type = parser->previous.type;
     ParseRule *rule = get_rule(type);
-    parse_precedence(rule->precedence+1);
+    parse_precedence(parser, rule->precedence+1);
     switch (type) {
-        case TOKEN_PLUS: emit_byte(OP_ADD); break;
-        case TOKEN_MINUS: emit_byte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emit_byte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emit_byte(OP_DIVIDE); break;
-        case TOKEN_BANG_EQUAL: emit_byte2(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emit_byte(OP_EQUAL); break;
-        case TOKEN_GREATER: emit_byte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emit_byte2(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emit_byte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emit_byte2(OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS: emit_byte(parser, OP_ADD); break;
+        case TOKEN_MINUS: emit_byte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR: emit_byte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH: emit_byte(parser, OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL: emit_byte2(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL: emit_byte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER: emit_byte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emit_byte2(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS: emit_byte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emit_byte2(parser, OP_GREATER, OP_NOT); break;
         default: break;
     }
 }
 
-static void literal(bool can_assign)
+static void literal(Parser *parser, bool can_assign)
 {
-    switch (parser.previous.type) {
-        case TOKEN_NIL: emit_byte(OP_NIL); break;
-        case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-        case TOKEN_TRUE: emit_byte(OP_TRUE); break;
+    switch (parser->previous.type) {
+        case TOKEN_NIL: emit_byte(parser, OP_NIL); break;
+        case TOKEN_FALSE: emit_byte(parser, OP_FALSE); break;
+        case TOKEN_TRUE: emit_byte(parser, OP_TRUE); break;
         default: break;
     }
 }
 
-static void number(bool can_assign)
+static void number(Parser *parser, bool can_assign)
+{
+    double value = strtod(parser->previous.start, NULL);
+    emit_constant(parser, NUMBER_VAL(value));
+}
+
+static void string(Parser *parser, bool can_assign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    emit_constant(parser, OBJ_VAL(copy_string(parser->vm, parser->previous.start+1, parser->previous.length-2)));
 }
 
-static void string(bool can_assign)
+static uint8_t identifier_constant(Parser *parser, Token name)
 {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start+1, parser.previous.length-2)));
+    return make_constant(parser, OBJ_VAL(copy_string(parser->vm, name.start, name.length)));
 }
 
-static uint8_t identifier_constant(Token name)
+static int global_variable(Parser *parser, Token name)
 {
-    return make_constant(OBJ_VAL(copy_string(name.start, name.length)));
+    int slot = global_slot(parser->vm, copy_string(parser->vm, name.start, name.length));
+    if (slot > UINT16_MAX) {
+        parse_error(parser, name, "Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
-static void begin_scope()
+static void begin_scope(Parser *parser)
 {
-    current->scope_depth++;
+    parser->compiler->scope_depth++;
 }
 
-static void end_scope()
+static void end_scope(Parser *parser)
 {
-    current->scope_depth--;
-    while (current->local_count > 0 && current->locals[current->local_count-1].depth > current->scope_depth) {
-        if (current->locals[current->local_count - 1].isCaptured) {
-      emit_byte(OP_CLOSE_UPVALUE);
+    parser->compiler->scope_depth--;
+    while (parser->compiler->local_count > 0 && parser->compiler->locals[parser->compiler->local_count-1].depth > parser->compiler->scope_depth) {
+        if (parser->compiler->locals[parser->compiler->local_count - 1].isCaptured) {
+      emit_byte(parser, OP_CLOSE_UPVALUE);
     } else {
-      emit_byte(OP_POP);
+      emit_byte(parser, OP_POP);
     }
-        current->local_count--;
+        parser->compiler->local_count--;
     }
 }
 
-static void add_local(Token name)
+static void add_local(Parser *parser, Token name)
 {
-    if (current->local_count == UINT8_COUNT) {
-        parse_error(name, "Too many local variables in function.");
+    if (parser->compiler->local_count == UINT8_COUNT) {
+        parse_error(parser, name, "Too many local variables in function.");
         return;
     }
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -324,54 +353,55 @@ static bool identifiers_equal(Token a, Token b)
     return memcmp(a.start, b.start, a.length) == 0;
 }
 
-static void declare_variable()
+static void declare_variable(Parser *parser)
 {
-    if (current->scope_depth == 0) return;
-    for (int i=current->local_count-1; i>=0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth) break;
-        if (identifiers_equal(parser.previous, local->name))
-            parse_error(parser.previous, "Already a variable with this name in this scope.");
+    if (parser->compiler->scope_depth == 0) return;
+    for (int i=parser->compiler->local_count-1; i>=0; i--) {
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth) break;
+        if (identifiers_equal(parser->previous, local->name))
+            parse_error(parser, parser->previous, "Already a variable with this name in this scope.");
     }
-    add_local(parser.previous);
+    add_local(parser, parser->previous);
 }
 
-static uint8_t parse_variable(const char *message)
+static int parse_variable(Parser *parser, const char *message)
 {
-    consume(TOKEN_IDENTIFIER, message);
-    declare_variable();
-    if (current->scope_depth > 0) return 0;
-    return identifier_constant(parser.previous);
+    consume(parser, TOKEN_IDENTIFIER, message);
+    declare_variable(parser);
+    if (parser->compiler->scope_depth > 0) return 0;
+    return global_variable(parser, parser->previous);
 }
 
-static void mark_initialized()
+static void mark_initialized(Parser *parser)
 {
-    if (current->scope_depth == 0) return;
-    current->locals[current->local_count-1].depth = current->scope_depth;
+    if (parser->compiler->scope_depth == 0) return;
+    parser->compiler->locals[parser->compiler->local_count-1].depth = parser->compiler->scope_depth;
 }
 
-static void define_variable(uint8_t index)
+static void define_variable(Parser *parser, int index)
 {
-    if (current->scope_depth > 0) {
-        mark_initialized();
+    if (parser->compiler->scope_depth > 0) {
+        mark_initialized(parser);
         return;
     }
-    emit_byte2(OP_DEFINE_GLOBAL, index);
+    emit_byte(parser, OP_DEFINE_GLOBAL);
+    emit_byte2(parser, (index >> 8) & 0xff, index & 0xff);
 }
 
-static int resolve_local(Compiler *compiler, Token name)
+static int resolve_local(Parser *parser, Compiler *compiler, Token name)
 {
     for (int i=compiler->local_count-1; i>=0; i--) {
         Local *local = &compiler->locals[i];
         if (identifiers_equal(local->name, name)) {
-            if (local->depth == -1) parse_error(name, "Can't read local variable in its own initializer.");
+            if (local->depth == -1) parse_error(parser, name, "Can't read local variable in its own initializer.");
             return i;
         }
     }
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index,
+static int addUpvalue(Parser *parser, Compiler* compiler, uint8_t index,
                       bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
   for (int i = 0; i < upvalueCount; i++) {
@@ -381,7 +411,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
     }
   }
   if (upvalueCount == UINT8_COUNT) {
-    parse_error(parser.previous, "Too many closure variables in function.");
+    parse_error(parser, parser->previous, "Too many closure variables in function.");
     return 0;
   }
   compiler->upvalues[upvalueCount].isLocal = isLocal;
@@ -389,119 +419,129 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token name) {
+static int resolveUpvalue(Parser *parser, Compiler* compiler, Token name) {
   if (compiler->enclosing == NULL) return -1;
 
-  int local = resolve_local(compiler->enclosing, name);
+  int local = resolve_local(parser, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
   }
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
-static void named_variable(Token name, bool can_assign)
+static void named_variable(Parser *parser, Token name, bool can_assign)
 {
     uint8_t get_op, set_op;
-    int index = resolve_local(current, name);
+    int index = resolve_local(parser, parser->compiler, name);
     if (index != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
     }
-    else if ((index = resolveUpvalue(current, name)) != -1) {
+    else if ((index = resolveUpvalue(parser, parser->compiler, name)) != -1) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     }
     else {
-        index = identifier_constant(name);
+        index = global_variable(parser, name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_byte2(set_op, index);
+    uint8_t op = get_op;
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        op = set_op;
+    }
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+        emit_byte(parser, op);
+        emit_byte2(parser, (index >> 8) & 0xff, index & 0xff);
     }
     else {
-        emit_byte2(get_op, index);
+        emit_byte2(parser, op, index);
     }
 }
 
-static void variable(bool can_assign)
+static void variable(Parser *parser, bool can_assign)
 {
-    named_variable(parser.previous, can_assign);
+    named_variable(parser, parser->previous, can_assign);
 }
 
-static void and(bool can_assign)
+static void and(Parser *parser, bool can_assign)
 {
-    int end_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
-    patch_jump(end_jump);
+    int end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_AND);
+    patch_jump(parser, end_jump);
 }
 
-static void or(bool can_assign)
+static void or(Parser *parser, bool can_assign)
 {
-    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(OP_JUMP);
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
+    int else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(parser, OP_JUMP);
+    patch_jump(parser, else_jump);
+    emit_byte(parser, OP_POP);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, end_jump);
 }
 
-static uint8_t argument_list()
+static uint8_t argument_list(Parser *parser)
 {
     uint8_t arg_count = 0;
-    if (parser.current.type != TOKEN_RIGHT_PAREN) {
+    if (parser->current.type != TOKEN_RIGHT_PAREN) {
         do {
-            expression();
+            expression(parser);
             if (arg_count == 255) {
-                parse_error(parser.previous, "Can't have more than 255 arguments.");
+                parse_error(parser, parser->previous, "Can't have more than 255 arguments.");
             }
             arg_count++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return arg_count;
 }
 
-static void call(bool can_assign)
+static void call(Parser *parser, bool can_assign)
 {
-    uint8_t arg_count = argument_list();
-    emit_byte2(OP_CALL, arg_count);
+    uint8_t arg_count = argument_list(parser);
+    parser->compiler->last_call = current_chunk(parser)->count;
+    emit_byte2(parser, OP_CALL, arg_count);
 }
 
-static void dot(bool can_assign)
+static void dot(Parser *parser, bool can_assign)
 {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(parser.previous);
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifier_constant(parser, parser->previous);
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_byte2(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argument_list();
-    emit_byte2(OP_INVOKE, name);
-    emit_byte(argCount);
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emit_byte2(parser, OP_SET_PROPERTY, name);
+        emit_inline_cache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argument_list(parser);
+    parser->compiler->last_call = current_chunk(parser)->count;
+    emit_byte2(parser, OP_INVOKE, name);
+    emit_byte(parser, argCount);
+    emit_inline_cache(parser);
     }
     else {
-        emit_byte2(OP_GET_PROPERTY, name);
+        emit_byte2(parser, OP_GET_PROPERTY, name);
+        emit_inline_cache(parser);
     }
 }
 
-static void this(bool can_assign)
+static void this(Parser *parser, bool can_assign)
 {
-    if (currentClass == NULL) {
-    parse_error(parser.previous, "Can't use 'this' outside of a class.");
+    if (parser->klass == NULL) {
+    parse_error(parser, parser->previous, "Can't use 'this' outside of a class.");
     return;
   }
 
-    variable(false);
+    variable(parser, false);
 }
 
 static Token syntheticToken(const char* text) {
@@ -511,33 +551,34 @@ static Token syntheticToken(const char* text) {
   return token;
 }
 
-static void super(bool can_assign)
+static void super(Parser *parser, bool can_assign)
 {
-    if (currentClass == NULL) {
-    parse_error(parser.previous, "Can't use 'super' outside of a class.");
-  } else if (!currentClass->hasSuperclass) {
-    parse_error(parser.previous, "Can't use 'super' in a class with no superclass.");
+    if (parser->klass == NULL) {
+    parse_error(parser, parser->previous, "Can't use 'super' outside of a class.");
+  } else if (!parser->klass->hasSuperclass) {
+    parse_error(parser, parser->previous, "Can't use 'super' in a class with no superclass.");
   }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(parser.previous);
-    named_variable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argument_list();
-    named_variable(syntheticToken("super"), false);
-    emit_byte2(OP_SUPER_INVOKE, name);
-    emit_byte(argCount);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifier_constant(parser, parser->previous);
+    named_variable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argument_list(parser);
+    named_variable(parser, syntheticToken("super"), false);
+    parser->compiler->last_call = current_chunk(parser)->count;
+    emit_byte2(parser, OP_SUPER_INVOKE, name);
+    emit_byte(parser, argCount);
   } else {
-    named_variable(syntheticToken("super"), false);
-    emit_byte2(OP_GET_SUPER, name);
+    named_variable(parser, syntheticToken("super"), false);
+    emit_byte2(parser, OP_GET_SUPER, name);
   }
 }
 
-static void grouping(bool can_assign)
+static void grouping(Parser *parser, bool can_assign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 static ParseRule rules[] = {
@@ -587,271 +628,281 @@ static ParseRule *get_rule(TokenType type)
     return &rules[type];
 }
 
-static void parse_precedence(Precedence precedence)
+static void parse_precedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFunc prefix = get_rule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFunc prefix = get_rule(parser->previous.type)->prefix;
     if (prefix == NULL) {
-        parse_error(parser.previous, "Expect expression.");
+        parse_error(parser, parser->previous, "Expect expression.");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix(can_assign);
+    prefix(parser, can_assign);
 
-    while (precedence <= get_rule(parser.current.type)->precedence) {
-        advance();
-        ParseFunc infix = get_rule(parser.previous.type)->infix;
-        infix(can_assign);
+    while (precedence <= get_rule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFunc infix = get_rule(parser->previous.type)->infix;
+        infix(parser, can_assign);
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) parse_error(parser.previous, "Invalid assignment target.");
+    if (can_assign && match(parser, TOKEN_EQUAL)) parse_error(parser, parser->previous, "Invalid assignment target.");
 }
 
-static void expression()
+static void expression(Parser *parser)
 {
-    parse_precedence(PREC_ASSIGNMENT);
+    parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void expression_statement()
+static void expression_statement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emit_byte(parser, OP_POP);
 }
 
-static void print_statement()
+static void print_statement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after print expression.");
-    emit_byte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after print expression.");
+    emit_byte(parser, OP_PRINT);
 }
 
-static void block()
+static void block(Parser *parser)
 {
-    while (parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF) {
-        declaration();
+    while (parser->current.type != TOKEN_RIGHT_BRACE && parser->current.type != TOKEN_EOF) {
+        declaration(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void block_statement()
+static void block_statement(Parser *parser)
 {
-    begin_scope();
-    block();
-    end_scope();
+    begin_scope(parser);
+    block(parser);
+    end_scope(parser);
 }
 
-static void if_statement()
+static void if_statement(Parser *parser)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
-    int else_jump = emit_jump(OP_JUMP);
-    patch_jump(then_jump);
-    emit_byte(OP_POP);
-    if (match(TOKEN_ELSE)) statement();
-    patch_jump(else_jump);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    statement(parser);
+    int else_jump = emit_jump(parser, OP_JUMP);
+    patch_jump(parser, then_jump);
+    emit_byte(parser, OP_POP);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patch_jump(parser, else_jump);
 }
 
-static void while_statement()
+static void while_statement(Parser *parser)
 {
-    int loop = current_chunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
-    emit_loop(loop);
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    int loop = current_chunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+    statement(parser);
+    emit_loop(parser, loop);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, OP_POP);
 }
 
-static void for_statement()
+static void for_statement(Parser *parser)
 {
-    begin_scope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {}
-    else if (match(TOKEN_VAR)) var_declaration();
-    else expression_statement();
-    int loop = current_chunk()->count;
+    begin_scope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {}
+    else if (match(parser, TOKEN_VAR)) var_declaration(parser);
+    else expression_statement(parser);
+    int loop = current_chunk(parser)->count;
     int exit_jump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
-    }
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int body_jump = emit_jump(OP_JUMP);
-        int inc_start = current_chunk()->count;
-        expression();
-        emit_byte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-        emit_loop(loop);
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+        emit_byte(parser, OP_POP);
+    }
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(parser, OP_JUMP);
+        int inc_start = current_chunk(parser)->count;
+        expression(parser);
+        emit_byte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        emit_loop(parser, loop);
         loop = inc_start;
-        patch_jump(body_jump);
+        patch_jump(parser, body_jump);
     }
-    statement();
-    emit_loop(loop);
+    statement(parser);
+    emit_loop(parser, loop);
     if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        patch_jump(parser, exit_jump);
+        emit_byte(parser, OP_POP);
     }
-    end_scope();
+    end_scope(parser);
 }
 
-static void return_statement()
+static void return_statement(Parser *parser)
 {
-    if (current->type == TYPE_SCRIPT) {
-        parse_error(parser.previous, "Can't return from top-level code.");
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        parse_error(parser, parser->previous, "Can't return from top-level code.");
     }
-    if (match(TOKEN_SEMICOLON)) {
-        emit_return();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emit_return(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-      parse_error(parser.previous, "Can't return a value from an initializer.");
-    }
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(OP_RETURN);
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+      parse_error(parser, parser->previous, "Can't return a value from an initializer.");
+    }
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // return f(...)/this.m(...)/super.m(...): 复用当前帧, 后面的OP_RETURN留给不能复用帧的调用
+        Chunk *chunk = current_chunk(parser);
+        int last = parser->compiler->last_call;
+        if (last >= 0 && last + instruction_length(chunk, last) == chunk->count) {
+            switch (chunk->code[last]) {
+                case OP_CALL:           chunk->code[last] = OP_TAIL_CALL; break;
+                case OP_INVOKE:         chunk->code[last] = OP_TAIL_INVOKE; break;
+                case OP_SUPER_INVOKE:   chunk->code[last] = OP_TAIL_SUPER_INVOKE; break;
+            }
+        }
+        emit_byte(parser, OP_RETURN);
     }
 }
 
-static void statement()
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT)) print_statement();
-    else if (match(TOKEN_LEFT_BRACE)) block_statement();
-    else if (match(TOKEN_IF)) if_statement();
-    else if (match(TOKEN_WHILE)) while_statement();
-    else if (match(TOKEN_FOR)) for_statement();
-    else if (match(TOKEN_RETURN)) return_statement();
-    else expression_statement();
+    if (match(parser, TOKEN_PRINT)) print_statement(parser);
+    else if (match(parser, TOKEN_LEFT_BRACE)) block_statement(parser);
+    else if (match(parser, TOKEN_IF)) if_statement(parser);
+    else if (match(parser, TOKEN_WHILE)) while_statement(parser);
+    else if (match(parser, TOKEN_FOR)) for_statement(parser);
+    else if (match(parser, TOKEN_RETURN)) return_statement(parser);
+    else expression_statement(parser);
 }
 
-static void var_declaration()
+static void var_declaration(Parser *parser)
 {
-    uint8_t name_idx = parse_variable("Expect variable name.");
-    if (match(TOKEN_EQUAL)) expression();
-    else emit_byte(OP_NIL);
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    define_variable(name_idx);
+    int name_idx = parse_variable(parser, "Expect variable name.");
+    if (match(parser, TOKEN_EQUAL)) expression(parser);
+    else emit_byte(parser, OP_NIL);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    define_variable(parser, name_idx);
 }
 
-static void function(FunctionType type)
+static void function(Parser *parser, FunctionType type)
 {
     Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
+    init_compiler(parser, &compiler, type);
+    begin_scope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (parser.current.type != TOKEN_RIGHT_PAREN) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (parser->current.type != TOKEN_RIGHT_PAREN) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                parse_error(parser.previous, "Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                parse_error(parser, parser->previous, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
-            define_variable(constant);
-        } while (match(TOKEN_COMMA));
+            int constant = parse_variable(parser, "Expect parameter name.");
+            define_variable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
 
-    ObjFunction* function = end();
-    emit_byte2(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    ObjFunction* function = end(parser);
+    emit_byte2(parser, OP_CLOSURE, make_constant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-    emit_byte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
+    emit_byte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    emit_byte(parser, compiler.upvalues[i].index);
   }
 }
 
-static void fun_declaration()
+static void fun_declaration(Parser *parser)
 {
-    uint8_t global = parse_variable("Expect function name.");
-    mark_initialized();
-    function(TYPE_FUNCTION);
-    define_variable(global);
+    int global = parse_variable(parser, "Expect function name.");
+    mark_initialized(parser);
+    function(parser, TYPE_FUNCTION);
+    define_variable(parser, global);
 }
 
-static void method() {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifier_constant(parser.previous);
+static void method(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifier_constant(parser, parser->previous);
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4 &&
-      memcmp(parser.previous.start, "init", 4) == 0) {
+  if (parser->previous.length == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
-  function(type);
-  emit_byte2(OP_METHOD, constant);
+  function(parser, type);
+  emit_byte2(parser, OP_METHOD, constant);
 }
 
 
 
-static void class_declaration()
+static void class_declaration(Parser *parser)
 {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifier_constant(parser.previous);
-    declare_variable();
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifier_constant(parser, parser->previous);
+    declare_variable(parser);
 
-    emit_byte2(OP_CLASS, nameConstant);
-    define_variable(nameConstant);
+    emit_byte2(parser, OP_CLASS, nameConstant);
+    define_variable(parser, parser->compiler->scope_depth > 0 ? 0 : global_variable(parser, className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-  classCompiler.enclosing = currentClass;
-  currentClass = &classCompiler;
+  classCompiler.enclosing = parser->klass;
+  parser->klass = &classCompiler;
 
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
 
-    if (identifiers_equal(className, parser.previous)) {
-      parse_error(parser.previous, "A class can't inherit from itself.");
+    if (identifiers_equal(className, parser->previous)) {
+      parse_error(parser, parser->previous, "A class can't inherit from itself.");
     }
 
-    begin_scope();
-    add_local(syntheticToken("super"));
-    define_variable(0);
+    begin_scope(parser);
+    add_local(parser, syntheticToken("super"));
+    define_variable(parser, 0);
 
 
-    named_variable(className, false);
-    emit_byte(OP_INHERIT);
+    named_variable(parser, className, false);
+    emit_byte(parser, OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
 
 
 
-    named_variable(className, false);
+    named_variable(parser, className, false);
 
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
 
-    while (parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF) method();
+    while (parser->current.type != TOKEN_RIGHT_BRACE && parser->current.type != TOKEN_EOF) method(parser);
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emit_byte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emit_byte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-    end_scope();
+    end_scope(parser);
   }
 
-    currentClass = currentClass->enclosing;
+    parser->klass = parser->klass->enclosing;
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.need_sync = false;
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON || parser.previous.type == TOKEN_RIGHT_BRACE) return;
-        switch (parser.current.type) {
+    parser->need_sync = false;
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON || parser->previous.type == TOKEN_RIGHT_BRACE) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -862,35 +913,35 @@ static void synchronize()
             case TOKEN_RETURN:
                 return;
         }
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-    if (match(TOKEN_VAR)) var_declaration();
-    else if (match(TOKEN_FUN)) fun_declaration();
-    else if (match(TOKEN_CLASS)) class_declaration();
-    else statement();
-    if (parser.need_sync) synchronize();
+    if (match(parser, TOKEN_VAR)) var_declaration(parser);
+    else if (match(parser, TOKEN_FUN)) fun_declaration(parser);
+    else if (match(parser, TOKEN_CLASS)) class_declaration(parser);
+    else statement(parser);
+    if (parser->need_sync) synchronize(parser);
 }
 
-ObjFunction *compile(const char *source)
+ObjFunction *compile(VM *vm, const char *source)
 {
-    init_scanner(&scanner, source);
-    init_parser();
+    Parser parser;
+    init_parser(&parser, vm, source);
     Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
-    advance();
-    while (!match(TOKEN_EOF)) declaration();
-    ObjFunction *function = end();
+    init_compiler(&parser, &compiler, TYPE_SCRIPT);
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF)) declaration(&parser);
+    ObjFunction *function = end(&parser);
     return (!parser.scan_error && !parser.parse_error) ? function : NULL;
 }
 
-void markCompilerRoots() {
-  Compiler* compiler = current;
+void markCompilerRoots(VM *vm) {
+  Compiler* compiler = vm->compiler;
   while (compiler != NULL) {
-    markObject((Obj*)compiler->function);
+    markObject(vm, (Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
 }
@@ -5,9 +5,9 @@
 #include "chunk.h"
 #include "obj_function.h"
 
-ObjFunction *compile(const char *source);
+ObjFunction *compile(VM *vm, const char *source);
 
-void markCompilerRoots();
+void markCompilerRoots(VM *vm);
 
 #endif
 
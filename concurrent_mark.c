@@ -0,0 +1,144 @@
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include "concurrent_mark.h"
+#include "memory.h"
+#include "vm.h"
+
+#define MARK_BATCH      (64)
+
+// gray stack和对象的scanned只在持有lock时修改.
+// 后台线程每处理MARK_BATCH个对象放开一次锁, 让mutator的屏障进来
+struct Marker {
+    VM *vm;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;       // 这一轮标记还没结束
+    bool idle;          // gray stack空了, mutator不拿锁读
+    int waiting;        // 等锁的mutator, 后台线程放开锁后让一让
+    bool shutdown;
+};
+
+// 扫描完才设置scanned: mutator看到scanned就可以直接改写, 后台线程不会再读这个对象
+static void scanObject(VM *vm, Obj *object) {
+    if (object->scanned == vm->markEpoch) return;
+    blackenObject(vm, object);
+    __atomic_store_n(&object->scanned, vm->markEpoch, __ATOMIC_RELEASE);
+}
+
+static void *markerThread(void *arg) {
+    Marker *marker = (Marker *)arg;
+    VM *vm = marker->vm;
+    pthread_mutex_lock(&marker->lock);
+    for (;;) {
+        while (!marker->shutdown && (!marker->running || vm->grayCount == 0)) {
+            if (marker->running)
+                __atomic_store_n(&marker->idle, true, __ATOMIC_RELEASE);
+            pthread_cond_wait(&marker->wake, &marker->lock);
+        }
+        if (marker->shutdown) break;
+        for (int i = 0; i < MARK_BATCH && vm->grayCount > 0; i++) {
+            scanObject(vm, vm->grayStack[--vm->grayCount]);
+        }
+        pthread_mutex_unlock(&marker->lock);
+        while (__atomic_load_n(&marker->waiting, __ATOMIC_ACQUIRE) > 0)
+            sched_yield();
+        pthread_mutex_lock(&marker->lock);
+    }
+    pthread_mutex_unlock(&marker->lock);
+    return NULL;
+}
+
+static Marker *newMarker(VM *vm) {
+    Marker *marker = (Marker *)malloc(sizeof(Marker));
+    if (marker == NULL) exit(1);
+    marker->vm = vm;
+    pthread_mutex_init(&marker->lock, NULL);
+    pthread_cond_init(&marker->wake, NULL);
+    marker->running = false;
+    marker->idle = false;
+    marker->waiting = 0;
+    marker->shutdown = false;
+
+    // 信号(比如SIGPROF)不能交给标记线程处理, 它读VM的状态时mutator还在跑
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int failed = pthread_create(&marker->thread, NULL, markerThread, marker);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed != 0) {
+        pthread_mutex_destroy(&marker->lock);
+        pthread_cond_destroy(&marker->wake);
+        free(marker);
+        return NULL;
+    }
+    return marker;
+}
+
+static void lockMarker(Marker *marker) {
+    __atomic_add_fetch(&marker->waiting, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&marker->lock);
+    __atomic_sub_fetch(&marker->waiting, 1, __ATOMIC_ACQ_REL);
+}
+
+// mutator放进gray stack的对象要叫醒已经闲下来的后台线程
+static void unlockMarker(Marker *marker) {
+    if (marker->idle && marker->vm->grayCount > 0) {
+        __atomic_store_n(&marker->idle, false, __ATOMIC_RELEASE);
+        pthread_cond_signal(&marker->wake);
+    }
+    pthread_mutex_unlock(&marker->lock);
+}
+
+bool start_marker(VM *vm) {
+    if (vm->marker == NULL) vm->marker = newMarker(vm);
+    Marker *marker = vm->marker;
+    if (marker == NULL) return false;
+    pthread_mutex_lock(&marker->lock);
+    marker->running = true;
+    marker->idle = false;
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+    return true;
+}
+
+bool marker_idle(VM *vm) {
+    return __atomic_load_n(&vm->marker->idle, __ATOMIC_ACQUIRE);
+}
+
+void stop_marker(VM *vm) {
+    Marker *marker = vm->marker;
+    lockMarker(marker);
+    marker->running = false;
+    marker->idle = false;
+    pthread_mutex_unlock(&marker->lock);
+}
+
+void snapshot_barrier(VM *vm, Obj *object) {
+    Marker *marker = vm->marker;
+    lockMarker(marker);
+    scanObject(vm, object);
+    unlockMarker(marker);
+}
+
+void shade_object(VM *vm, Obj *object) {
+    Marker *marker = vm->marker;
+    lockMarker(marker);
+    markObject(vm, object);
+    unlockMarker(marker);
+}
+
+void free_marker(Marker *marker) {
+    if (marker == NULL) return;
+    pthread_mutex_lock(&marker->lock);
+    marker->shutdown = true;
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+    pthread_join(marker->thread, NULL);
+    pthread_mutex_destroy(&marker->lock);
+    pthread_cond_destroy(&marker->wake);
+    free(marker);
+}
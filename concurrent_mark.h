@@ -0,0 +1,28 @@
+
+#ifndef _CONCURRENT_MARK_H_
+#define _CONCURRENT_MARK_H_
+
+#include "common.h"
+#include "object.h"
+
+typedef struct Marker Marker;
+
+// 根已经标记好, 让后台线程开始处理gray stack; 线程建不起来时返回false
+bool start_marker(VM *vm);
+
+// gray stack处理完了, mutator可以来结束这一轮
+bool marker_idle(VM *vm);
+
+// 让后台线程停下, 之后gray stack归mutator
+void stop_marker(VM *vm);
+
+// SNAPSHOT_BARRIER的慢路径: 对象第一次被改写之前由mutator扫描
+void snapshot_barrier(VM *vm, Obj *object);
+
+// 从弱引用(字符串驻留表)里重新拿到的对象要标记上
+void shade_object(VM *vm, Obj *object);
+
+void free_marker(Marker *marker);
+
+#endif
+
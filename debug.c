@@ -3,12 +3,13 @@
 #include "debug.h"
 #include "value.h"
 #include "obj_function.h"
+#include "vm.h"
 
-void disassemble_chunk(Chunk *chunk, const char *name)
+void disassemble_chunk(VM *vm, Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
     for (int offset=0; offset<chunk->count;)
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
 }
 
 static int simple_instruction(const char *name, int offset)
@@ -26,6 +27,15 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int globalInstruction(VM *vm, const char* name, Chunk* chunk,
+                             int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '%s'\n", name, slot,
+         AS_CSTRING(vm->globalNames.values[slot]));
+  return offset + 3;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk,
                            int offset) {
   uint8_t slot = chunk->code[offset + 1];
@@ -42,6 +52,29 @@ static int invokeInstruction(const char* name, Chunk* chunk,
   return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk,
+                               int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("' [ic %d]\n", cache);
+  return offset + 4;
+}
+
+static int invokeCachedInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("' [ic %d]\n", cache);
+  return offset + 5;
+}
+
 static int jumpInstruction(const char* name, int sign,
                            Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -51,14 +84,24 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset)
+static int fusedInstruction(const char* name, Chunk* chunk,
+                            int offset, int length) {
+  printf("%-16s", name);
+  for (int i = offset + 1; i < offset + length; i += 2) {
+    printf(" %4d", chunk->code[i]);
+  }
+  printf("\n");
+  return offset + length;
+}
+
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset-1]) {
+    if (offset > 0 && get_line(chunk, offset) == get_line(chunk, offset-1)) {
         printf("   | ");
     }
     else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", get_line(chunk, offset));
     }
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
@@ -82,16 +125,22 @@ int disassembleInstruction(Chunk *chunk, int offset)
         SIMPLE_INSTRUCTION(OP_PRINT);
         SIMPLE_INSTRUCTION(OP_POP);
         SIMPLE_INSTRUCTION(OP_RETURN);
+        SIMPLE_INSTRUCTION(OP_ADD_NUM);
+        SIMPLE_INSTRUCTION(OP_ADD_STR);
+        SIMPLE_INSTRUCTION(OP_SUBTRACT_NUM);
+        SIMPLE_INSTRUCTION(OP_MULTIPLY_NUM);
+        SIMPLE_INSTRUCTION(OP_DIVIDE_NUM);
+        SIMPLE_INSTRUCTION(OP_GREATER_NUM);
+        SIMPLE_INSTRUCTION(OP_LESS_NUM);
 
         case OP_DEFINE_GLOBAL:
-      return constant_instruction("OP_DEFINE_GLOBAL", chunk,
-                                 offset);
+      return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
 
         case OP_GET_GLOBAL:
-      return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
 
       case OP_SET_GLOBAL:
-      return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
 
       case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -113,6 +162,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
 
       case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+      case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
       case OP_CLOSURE: {
       offset++;
       uint8_t constant = chunk->code[offset++];
@@ -135,13 +186,15 @@ int disassembleInstruction(Chunk *chunk, int offset)
       case OP_CLASS:
       return constant_instruction("OP_CLASS", chunk, offset);
       case OP_GET_PROPERTY:
-      return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
       case OP_METHOD:
       return constant_instruction("OP_METHOD", chunk, offset);
       case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return invokeCachedInstruction("OP_INVOKE", chunk, offset);
+      case OP_TAIL_INVOKE:
+      return invokeCachedInstruction("OP_TAIL_INVOKE", chunk, offset);
 
       case OP_INHERIT:
       return simple_instruction("OP_INHERIT", offset);
@@ -149,6 +202,26 @@ int disassembleInstruction(Chunk *chunk, int offset)
       return constant_instruction("OP_GET_SUPER", chunk, offset);
       case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+      case OP_TAIL_SUPER_INVOKE:
+      return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+
+      case OP_ADD_LOCAL_LOCAL:
+      return fusedInstruction("OP_ADD_LOCAL_LOCAL", chunk, offset, 5);
+      case OP_LESS_LOCAL_CONSTANT_JUMP: {
+      uint16_t jump = (uint16_t)(chunk->code[offset + 6] << 8);
+      jump |= chunk->code[offset + 7];
+      printf("%-16s %4d %4d -> %d\n", "OP_LESS_LOCAL_CONSTANT_JUMP",
+             chunk->code[offset + 1], chunk->code[offset + 3],
+             offset + 8 + jump);
+      return offset + 9;
+    }
+      case OP_GET_PROPERTY_SET_LOCAL: {
+      uint8_t constant = chunk->code[offset + 1];
+      printf("%-16s %4d '", "OP_GET_PROPERTY_SET_LOCAL", constant);
+      print_value(chunk->constants.values[constant]);
+      printf("' -> %d\n", chunk->code[offset + 5]);
+      return offset + 6;
+    }
 
         default:
             printf("Unknown opcode %d\n", instruction);
@@ -158,56 +231,69 @@ int disassembleInstruction(Chunk *chunk, int offset)
     }
 }
 
-void print_object(Value value)
+static void fprint_object(FILE *fp, Value value)
 {
     switch (OBJ_TYPE(value)) {
-        case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
+        case OBJ_STRING: fprintf(fp, "%s", AS_CSTRING(value)); break;
         case OBJ_FUNCTION:
 
-        printf("<fn %s>", AS_FUNCTION(value)->name == NULL? "<script>":AS_FUNCTION(value)->name->chars); break;
+        fprintf(fp, "<fn %s>", AS_FUNCTION(value)->name == NULL? "<script>":AS_FUNCTION(value)->name->chars); break;
         case OBJ_NATIVE:
-      printf("<native fn>");
+      fprintf(fp, "<native fn>");
       break;
       case OBJ_CLOSURE:
     //   print_function(AS_CLOSURE(value)->function);
-    printf("closure");
+    fprintf(fp, "closure");
       break;
       case OBJ_UPVALUE:
-      printf("upvalue");
+      fprintf(fp, "upvalue");
       break;
       case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      fprintf(fp, "%s", AS_CLASS(value)->name->chars);
       break;
       case OBJ_INSTANCE:
-      printf("%s instance",
+      fprintf(fp, "%s instance",
              AS_INSTANCE(value)->klass->name->chars);
 
       break;
       case OBJ_BOUND_METHOD:
       // printFunction(AS_BOUND_METHOD(value)->method->function);
       break;
+      case OBJ_SHAPE:
+      fprintf(fp, "shape");
+      break;
+      case OBJ_FIBER:
+      fprintf(fp, "fiber");
+      break;
     }
 }
 
-void print_value(Value value)
+void fprint_value(FILE *fp, Value value)
 {
   #ifdef NAN_BOXING
   if (IS_BOOL(value)) {
-    printf(AS_BOOL(value) ? "true" : "false");
+    fprintf(fp, AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {
-    printf("nil");
+    fprintf(fp, "nil");
   } else if (IS_NUMBER(value)) {
-    printf("%g", AS_NUMBER(value));
+    fprintf(fp, "%g", AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
-    print_object(value);
+    fprint_object(fp, value);
+  } else if (IS_UNDEFINED(value)) {
+    fprintf(fp, "undefined");
   }
 #else
     switch (value.type) {
-        case VAL_NIL: printf("nil"); break;
-        case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ: print_object(value); break;
+        case VAL_NIL: fprintf(fp, "nil"); break;
+        case VAL_BOOL: fprintf(fp, AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NUMBER: fprintf(fp, "%g", AS_NUMBER(value)); break;
+        case VAL_OBJ: fprint_object(fp, value); break;
+        case VAL_UNDEFINED: fprintf(fp, "undefined"); break;
     }
     #endif
 }
 
+void print_value(Value value)
+{
+    fprint_value(stdout, value);
+}
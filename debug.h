@@ -4,9 +4,11 @@
 
 #include "chunk.h"
 
-void disassemble_chunk(Chunk *chunk, const char *name);
+void disassemble_chunk(VM *vm, Chunk *chunk, const char *name);
 
-int disassembleInstruction(Chunk *chunk, int offset);
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset);
+
+void fprint_value(FILE *fp, Value value);
 
 void print_value(Value value);
 
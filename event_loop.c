@@ -0,0 +1,330 @@
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "event_loop.h"
+#include "obj_fiber.h"
+#include "memory.h"
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void init_loop(EventLoop *loop)
+{
+    loop->epfd = -1;
+    loop->fds = NULL;
+    loop->fdCapacity = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->timerSeq = 0;
+    loop->ready = NULL;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->pending = 0;
+}
+
+void free_loop(VM *vm, EventLoop *loop)
+{
+    if (loop->epfd >= 0) close(loop->epfd);
+    FREE_ARRAY(vm, FdWaiters, loop->fds, loop->fdCapacity);
+    FREE_ARRAY(vm, Timer, loop->timers, loop->timerCapacity);
+    FREE_ARRAY(vm, ReadyFiber, loop->ready, loop->readyCapacity);
+    init_loop(loop);
+}
+
+void mark_loop(VM *vm, EventLoop *loop)
+{
+    for (int i = 0; i < loop->fdCapacity; i++) {
+        if (loop->fds[i].events == 0) continue;
+        markObject(vm, (Obj *)loop->fds[i].read.fiber);
+        markObject(vm, (Obj *)loop->fds[i].write.fiber);
+        markValue(vm, loop->fds[i].write.value);
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+        markObject(vm, (Obj *)loop->timers[i].fiber);
+    }
+    for (int i = loop->readyHead; i < loop->readyCount; i++) {
+        markObject(vm, (Obj *)loop->ready[i].fiber);
+        markValue(vm, loop->ready[i].value);
+    }
+}
+
+// 出错后丢弃所有等待中的fiber
+void reset_loop(VM *vm, EventLoop *loop)
+{
+    for (int i = 0; i < loop->fdCapacity; i++) {
+        FdWaiters *waiters = &loop->fds[i];
+        if (waiters->events == 0) continue;
+        if (waiters->read.fiber != NULL) waiters->read.fiber->state = FIBER_DONE;
+        if (waiters->write.fiber != NULL) waiters->write.fiber->state = FIBER_DONE;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, i, NULL);
+        waiters->read.fiber = NULL;
+        waiters->write.fiber = NULL;
+        waiters->write.value = NIL_VAL;
+        waiters->events = 0;
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+        loop->timers[i].fiber->state = FIBER_DONE;
+    }
+    for (int i = loop->readyHead; i < loop->readyCount; i++) {
+        loop->ready[i].fiber->state = FIBER_DONE;
+    }
+    loop->timerCount = 0;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->pending = 0;
+}
+
+bool loop_busy(EventLoop *loop)
+{
+    return loop->readyHead < loop->readyCount || loop->pending > 0;
+}
+
+void loop_ready(VM *vm, ObjFiber *fiber, Value value)
+{
+    EventLoop *loop = &vm->loop;
+    if (loop->readyCount == loop->readyCapacity && loop->readyHead > 0) {
+        memmove(loop->ready, loop->ready + loop->readyHead,
+                sizeof(ReadyFiber) * (loop->readyCount - loop->readyHead));
+        loop->readyCount -= loop->readyHead;
+        loop->readyHead = 0;
+    }
+    if (loop->readyCount == loop->readyCapacity) {
+        push(vm, value);
+        int capacity = GROW_CAPACITY(loop->readyCapacity);
+        loop->ready = GROW_ARRAY(vm, ReadyFiber, loop->ready, loop->readyCapacity, capacity);
+        loop->readyCapacity = capacity;
+        pop(vm);
+    }
+    loop->ready[loop->readyCount].fiber = fiber;
+    loop->ready[loop->readyCount].value = value;
+    loop->readyCount++;
+    fiber->state = FIBER_WAITING;
+}
+
+static bool update_fd(EventLoop *loop, int fd, uint32_t events)
+{
+    FdWaiters *waiters = &loop->fds[fd];
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    int op = waiters->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epfd, op, fd, &event) != 0) return false;
+    waiters->events = events;
+    return true;
+}
+
+static Waiter *fd_waiter(VM *vm, int fd, bool write)
+{
+    EventLoop *loop = &vm->loop;
+    if (loop->epfd < 0) {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) return NULL;
+    }
+    if (fd >= loop->fdCapacity) {
+        int capacity = loop->fdCapacity;
+        while (capacity <= fd) capacity = GROW_CAPACITY(capacity);
+        loop->fds = GROW_ARRAY(vm, FdWaiters, loop->fds, loop->fdCapacity, capacity);
+        for (int i = loop->fdCapacity; i < capacity; i++) {
+            loop->fds[i].read = (Waiter){NULL, NIL_VAL, 0};
+            loop->fds[i].write = (Waiter){NULL, NIL_VAL, 0};
+            loop->fds[i].events = 0;
+        }
+        loop->fdCapacity = capacity;
+    }
+    Waiter *waiter = write ? &loop->fds[fd].write : &loop->fds[fd].read;
+    return waiter->fiber == NULL ? waiter : NULL;
+}
+
+bool loop_wait_read(VM *vm, int fd, int size, ObjFiber *fiber)
+{
+    Waiter *waiter = fd_waiter(vm, fd, false);
+    if (waiter == NULL) return false;
+    if (!update_fd(&vm->loop, fd, vm->loop.fds[fd].events | EPOLLIN)) return false;
+    waiter->fiber = fiber;
+    waiter->size = size;
+    vm->loop.pending++;
+    return true;
+}
+
+bool loop_wait_write(VM *vm, int fd, Value string, ObjFiber *fiber)
+{
+    Waiter *waiter = fd_waiter(vm, fd, true);
+    if (waiter == NULL) return false;
+    if (!update_fd(&vm->loop, fd, vm->loop.fds[fd].events | EPOLLOUT)) return false;
+    waiter->fiber = fiber;
+    waiter->value = string;
+    vm->loop.pending++;
+    return true;
+}
+
+static bool timer_before(Timer *a, Timer *b)
+{
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+void loop_sleep(VM *vm, double ms, ObjFiber *fiber)
+{
+    EventLoop *loop = &vm->loop;
+    if (loop->timerCount == loop->timerCapacity) {
+        int capacity = GROW_CAPACITY(loop->timerCapacity);
+        loop->timers = GROW_ARRAY(vm, Timer, loop->timers, loop->timerCapacity, capacity);
+        loop->timerCapacity = capacity;
+    }
+    Timer timer = {now_ms() + ms, loop->timerSeq++, fiber};
+    int i = loop->timerCount++;
+    while (i > 0 && timer_before(&timer, &loop->timers[(i - 1) / 2])) {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i] = timer;
+    loop->pending++;
+}
+
+static void pop_timer(EventLoop *loop)
+{
+    Timer last = loop->timers[--loop->timerCount];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= loop->timerCount) break;
+        if (child + 1 < loop->timerCount &&
+            timer_before(&loop->timers[child + 1], &loop->timers[child])) child++;
+        if (!timer_before(&loop->timers[child], &last)) break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    loop->timers[i] = last;
+    loop->pending--;
+}
+
+// 关闭fd时唤醒等在上面的fiber, 结果为nil
+void loop_cancel_fd(VM *vm, int fd)
+{
+    EventLoop *loop = &vm->loop;
+    if (fd < 0 || fd >= loop->fdCapacity || loop->fds[fd].events == 0) return;
+    FdWaiters *waiters = &loop->fds[fd];
+    update_fd(loop, fd, 0);
+    if (waiters->read.fiber != NULL) {
+        loop_ready(vm, waiters->read.fiber, NIL_VAL);
+        waiters->read.fiber = NULL;
+        loop->pending--;
+    }
+    if (waiters->write.fiber != NULL) {
+        loop_ready(vm, waiters->write.fiber, NIL_VAL);
+        waiters->write.fiber = NULL;
+        waiters->write.value = NIL_VAL;
+        loop->pending--;
+    }
+}
+
+// 返回false表示需要等待; 读到文件尾或出错时结果为nil
+bool loop_try_read(VM *vm, int fd, int size, Value *result)
+{
+    char *chars = ALLOCATE_ARRAY(vm, char, size + 1);
+    ssize_t n = read(fd, chars, size);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        FREE_ARRAY(vm, char, chars, size + 1);
+        return false;
+    }
+    if (n <= 0) {
+        FREE_ARRAY(vm, char, chars, size + 1);
+        *result = NIL_VAL;
+        return true;
+    }
+    chars = GROW_ARRAY(vm, char, chars, size + 1, n + 1);
+    chars[n] = '\0';
+    *result = OBJ_VAL(take_string(vm, chars, (int)n));
+    return true;
+}
+
+bool loop_try_write(VM *vm, int fd, Value string, Value *result)
+{
+    ObjString *s = AS_STRING(string);
+    ssize_t n = write(fd, s->chars, s->length);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+    *result = n < 0 ? NIL_VAL : NUMBER_VAL((double)n);
+    return true;
+}
+
+static void complete(VM *vm, int fd, bool write)
+{
+    EventLoop *loop = &vm->loop;
+    Waiter *waiter = write ? &loop->fds[fd].write : &loop->fds[fd].read;
+    Value result;
+    bool done = write ? loop_try_write(vm, fd, waiter->value, &result)
+                      : loop_try_read(vm, fd, waiter->size, &result);
+    if (!done) return;
+
+    ObjFiber *fiber = waiter->fiber;
+    waiter->fiber = NULL;
+    waiter->value = NIL_VAL;
+    loop->pending--;
+    update_fd(loop, fd, loop->fds[fd].events & ~(write ? EPOLLOUT : EPOLLIN));
+    push(vm, OBJ_VAL(fiber));
+    loop_ready(vm, fiber, result);
+    pop(vm);
+}
+
+static void poll_events(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    int timeout = -1;
+    if (loop->timerCount > 0) {
+        double wait = loop->timers[0].deadline - now_ms();
+        timeout = wait <= 0 ? 0 : (int)wait + 1;
+    }
+
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int count = 0;
+    if (loop->pending > loop->timerCount) {
+        count = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout);
+        if (count < 0) count = 0;
+    } else if (timeout > 0) {
+        struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    double now = now_ms();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= now) {
+        ObjFiber *fiber = loop->timers[0].fiber;
+        pop_timer(loop);
+        push(vm, OBJ_VAL(fiber));
+        loop_ready(vm, fiber, NIL_VAL);
+        pop(vm);
+    }
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ready = events[i].events;
+        if (ready & (EPOLLERR | EPOLLHUP)) ready |= EPOLLIN | EPOLLOUT;
+        if ((ready & EPOLLIN) && loop->fds[fd].read.fiber != NULL) complete(vm, fd, false);
+        if ((ready & EPOLLOUT) && loop->fds[fd].write.fiber != NULL) complete(vm, fd, true);
+    }
+}
+
+// 取下一个可运行的fiber, 没有时阻塞在epoll上; 什么都不等时返回NULL
+ObjFiber *loop_next(VM *vm, Value *value)
+{
+    EventLoop *loop = &vm->loop;
+    while (loop->readyHead == loop->readyCount) {
+        if (loop->pending == 0) return NULL;
+        poll_events(vm);
+    }
+    ReadyFiber *next = &loop->ready[loop->readyHead++];
+    *value = next->value;
+    ObjFiber *fiber = next->fiber;
+    if (loop->readyHead == loop->readyCount) {
+        loop->readyHead = 0;
+        loop->readyCount = 0;
+    }
+    return fiber;
+}
+
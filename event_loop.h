@@ -0,0 +1,77 @@
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "common.h"
+#include "value.h"
+
+#define LOOP_READ_SIZE      (4096)
+#define LOOP_MAX_EVENTS     (64)
+
+typedef struct {
+    struct ObjFiber *fiber;
+    Value value;    // 要写入的字符串
+    int size;       // 最多读取的字节数
+}Waiter;
+
+typedef struct {
+    Waiter read;
+    Waiter write;
+    uint32_t events;
+}FdWaiters;
+
+typedef struct {
+    double deadline;
+    uint64_t seq;
+    struct ObjFiber *fiber;
+}Timer;
+
+typedef struct {
+    struct ObjFiber *fiber;
+    Value value;
+}ReadyFiber;
+
+// 每个VM一个事件循环, epoll只在第一次等待时创建
+typedef struct {
+    int epfd;
+    FdWaiters *fds;
+    int fdCapacity;
+    Timer *timers;
+    int timerCount;
+    int timerCapacity;
+    uint64_t timerSeq;
+    ReadyFiber *ready;
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+    int pending;
+}EventLoop;
+
+void init_loop(EventLoop *loop);
+
+void free_loop(VM *vm, EventLoop *loop);
+
+void mark_loop(VM *vm, EventLoop *loop);
+
+void reset_loop(VM *vm, EventLoop *loop);
+
+bool loop_busy(EventLoop *loop);
+
+void loop_ready(VM *vm, struct ObjFiber *fiber, Value value);
+
+bool loop_wait_read(VM *vm, int fd, int size, struct ObjFiber *fiber);
+
+bool loop_wait_write(VM *vm, int fd, Value string, struct ObjFiber *fiber);
+
+void loop_sleep(VM *vm, double ms, struct ObjFiber *fiber);
+
+void loop_cancel_fd(VM *vm, int fd);
+
+bool loop_try_read(VM *vm, int fd, int size, Value *result);
+
+bool loop_try_write(VM *vm, int fd, Value string, Value *result);
+
+struct ObjFiber *loop_next(VM *vm, Value *value);
+
+#endif
+
@@ -0,0 +1,388 @@
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_NO_ENTRY        UINT32_MAX
+
+typedef struct {
+    VM *vm;
+    uint8_t *code;
+    int count;
+    int capacity;
+}Buffer;
+
+typedef struct {
+    int at;
+    int target;
+}Fixup;
+
+static void emit(Buffer *buf, const uint8_t *bytes, int length)
+{
+    if (buf->capacity < buf->count+length) {
+        while (buf->capacity < buf->count+length)
+            buf->capacity = GROW_CAPACITY(buf->capacity);
+        buf->code = (uint8_t *)realloc(buf->code, buf->capacity);
+        if (buf->code == NULL) exit(1);
+    }
+    memcpy(buf->code+buf->count, bytes, length);
+    buf->count += length;
+}
+
+static void emit_u8(Buffer *buf, uint8_t byte)
+{
+    emit(buf, &byte, 1);
+}
+
+static void emit_u32(Buffer *buf, uint32_t value)
+{
+    emit(buf, (uint8_t *)&value, 4);
+}
+
+static void emit_u64(Buffer *buf, uint64_t value)
+{
+    emit(buf, (uint8_t *)&value, 8);
+}
+
+// mov rdi, vm; mov rsi, rbx; mov rdx, ip; mov rax, helper; call rax
+static void emit_helper_call(Buffer *buf, JitHelper helper, uint8_t *ip)
+{
+    emit(buf, (const uint8_t []){0x48, 0xbf}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)buf->vm);
+    emit(buf, (const uint8_t []){0x48, 0x89, 0xde}, 3);
+    emit(buf, (const uint8_t []){0x48, 0xba}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)ip);
+    emit(buf, (const uint8_t []){0x48, 0xb8}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)helper);
+    emit(buf, (const uint8_t []){0xff, 0xd0}, 2);
+}
+
+// test eax, eax; jnz rel32
+static int emit_jnz(Buffer *buf)
+{
+    emit(buf, (const uint8_t []){0x85, 0xc0, 0x0f, 0x85}, 4);
+    emit_u32(buf, 0);
+    return buf->count - 4;
+}
+
+// jmp rel32
+static int emit_jmp(Buffer *buf)
+{
+    emit_u8(buf, 0xe9);
+    emit_u32(buf, 0);
+    return buf->count - 4;
+}
+
+static void patch_rel32(Buffer *buf, int at, int target)
+{
+    int32_t rel = target - (at + 4);
+    memcpy(buf->code+at, &rel, 4);
+}
+
+#ifdef NAN_BOXING
+// 简单指令直接生成机器码, rcx = &vm->top, rdx = vm->top
+
+static void emit_load_top(Buffer *buf)
+{
+    emit(buf, (const uint8_t []){0x48, 0xb9}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)&buf->vm->top);
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x11}, 3);
+}
+
+// mov [rdx], rax; add qword [rcx], 8
+static void emit_push_rax(Buffer *buf)
+{
+    emit(buf, (const uint8_t []){0x48, 0x89, 0x02, 0x48, 0x83, 0x01, 0x08}, 7);
+}
+
+static void emit_push_value(Buffer *buf, Value value)
+{
+    emit(buf, (const uint8_t []){0x48, 0xb8}, 2);
+    emit_u64(buf, value);
+    emit_load_top(buf);
+    emit_push_rax(buf);
+}
+
+// mov rax, [rbx+slots]
+static void emit_load_slots(Buffer *buf)
+{
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x83}, 3);
+    emit_u32(buf, offsetof(CallFrame, slots));
+}
+
+static void emit_get_local(Buffer *buf, uint8_t slot)
+{
+    emit_load_slots(buf);
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x80}, 3);
+    emit_u32(buf, slot * sizeof(Value));
+    emit_load_top(buf);
+    emit_push_rax(buf);
+}
+
+static void emit_set_local(Buffer *buf, uint8_t slot)
+{
+    emit_load_top(buf);
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x52, 0xf8}, 4);
+    emit_load_slots(buf);
+    emit(buf, (const uint8_t []){0x48, 0x89, 0x90}, 3);
+    emit_u32(buf, slot * sizeof(Value));
+}
+
+static void emit_pop(Buffer *buf)
+{
+    emit(buf, (const uint8_t []){0x48, 0xb9}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)&buf->vm->top);
+    emit(buf, (const uint8_t []){0x48, 0x83, 0x29, 0x08}, 4);
+}
+
+// 栈顶是false或nil时跳转, 返回两个需要回填的位置
+static void emit_jump_if_false(Buffer *buf, int *at)
+{
+    emit(buf, (const uint8_t []){0x48, 0xb9}, 2);
+    emit_u64(buf, (uint64_t)(uintptr_t)&buf->vm->top);
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x01, 0x48, 0x8b, 0x40, 0xf8, 0x48, 0xba}, 9);
+    emit_u64(buf, FALSE_VAL);
+    emit(buf, (const uint8_t []){0x48, 0x39, 0xd0, 0x0f, 0x84}, 5);
+    emit_u32(buf, 0);
+    at[0] = buf->count - 4;
+    emit(buf, (const uint8_t []){0x48, 0xba}, 2);
+    emit_u64(buf, NIL_VAL);
+    emit(buf, (const uint8_t []){0x48, 0x39, 0xd0, 0x0f, 0x84}, 5);
+    emit_u32(buf, 0);
+    at[1] = buf->count - 4;
+}
+
+// 已经被快速化为数字运算的指令: 两个操作数都是数字时直接用SSE计算, 否则调用通用helper
+static void emit_number_op(Buffer *buf, uint8_t op, uint8_t *ip, int epilogue)
+{
+    emit_load_top(buf);
+    // mov rax, [rdx-16]; mov rsi, [rdx-8]; mov rdi, QNAN
+    emit(buf, (const uint8_t []){0x48, 0x8b, 0x42, 0xf0, 0x48, 0x8b, 0x72, 0xf8, 0x48, 0xbf}, 10);
+    emit_u64(buf, QNAN);
+    // mov r8, rax; and r8, rdi; cmp r8, rdi; je slow
+    emit(buf, (const uint8_t []){0x49, 0x89, 0xc0, 0x49, 0x21, 0xf8, 0x49, 0x39, 0xf8, 0x0f, 0x84}, 11);
+    emit_u32(buf, 0);
+    int slow_a = buf->count - 4;
+    // mov r8, rsi; and r8, rdi; cmp r8, rdi; je slow
+    emit(buf, (const uint8_t []){0x49, 0x89, 0xf0, 0x49, 0x21, 0xf8, 0x49, 0x39, 0xf8, 0x0f, 0x84}, 11);
+    emit_u32(buf, 0);
+    int slow_b = buf->count - 4;
+    // movq xmm0, rax; movq xmm1, rsi
+    emit(buf, (const uint8_t []){0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f, 0x6e, 0xce}, 10);
+
+    uint8_t generic = op;
+    switch (op) {
+        case OP_ADD_NUM:        generic = OP_ADD;       emit(buf, (const uint8_t []){0xf2, 0x0f, 0x58, 0xc1}, 4); break;
+        case OP_SUBTRACT_NUM:   generic = OP_SUBTRACT;  emit(buf, (const uint8_t []){0xf2, 0x0f, 0x5c, 0xc1}, 4); break;
+        case OP_MULTIPLY_NUM:   generic = OP_MULTIPLY;  emit(buf, (const uint8_t []){0xf2, 0x0f, 0x59, 0xc1}, 4); break;
+        case OP_DIVIDE_NUM:     generic = OP_DIVIDE;    emit(buf, (const uint8_t []){0xf2, 0x0f, 0x5e, 0xc1}, 4); break;
+        // ucomisd xmm0, xmm1 / ucomisd xmm1, xmm0; seta al
+        case OP_GREATER_NUM:    generic = OP_GREATER;   emit(buf, (const uint8_t []){0x66, 0x0f, 0x2e, 0xc1, 0x0f, 0x97, 0xc0}, 7); break;
+        case OP_LESS_NUM:       generic = OP_LESS;      emit(buf, (const uint8_t []){0x66, 0x0f, 0x2e, 0xc8, 0x0f, 0x97, 0xc0}, 7); break;
+    }
+    if (generic == OP_GREATER || generic == OP_LESS) {
+        // movzx eax, al; mov rdi, FALSE_VAL; or rax, rdi
+        emit(buf, (const uint8_t []){0x0f, 0xb6, 0xc0, 0x48, 0xbf}, 5);
+        emit_u64(buf, FALSE_VAL);
+        emit(buf, (const uint8_t []){0x48, 0x09, 0xf8}, 3);
+    }
+    else {
+        // movq rax, xmm0
+        emit(buf, (const uint8_t []){0x66, 0x48, 0x0f, 0x7e, 0xc0}, 5);
+    }
+    // mov [rdx-16], rax; sub qword [rcx], 8
+    emit(buf, (const uint8_t []){0x48, 0x89, 0x42, 0xf0, 0x48, 0x83, 0x29, 0x08}, 8);
+    int done = emit_jmp(buf);
+
+    patch_rel32(buf, slow_a, buf->count);
+    patch_rel32(buf, slow_b, buf->count);
+    emit_helper_call(buf, jit_helpers[generic], ip);
+    patch_rel32(buf, emit_jnz(buf), epilogue);
+    patch_rel32(buf, done, buf->count);
+}
+#endif
+
+// 融合指令和快速化指令在机器码里按原来的第一条指令翻译
+static uint8_t base_opcode(Chunk *chunk, int offset, int *length)
+{
+    uint8_t op = chunk->code[offset];
+    switch (op) {
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            *length = 2;
+            return OP_GET_LOCAL;
+        case OP_GET_PROPERTY_SET_LOCAL:
+            *length = 4;
+            return OP_GET_PROPERTY;
+        case OP_ADD_STR:        *length = 1; return OP_ADD;
+#ifndef NAN_BOXING
+        case OP_ADD_NUM:        *length = 1; return OP_ADD;
+        case OP_SUBTRACT_NUM:   *length = 1; return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:   *length = 1; return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:     *length = 1; return OP_DIVIDE;
+        case OP_GREATER_NUM:    *length = 1; return OP_GREATER;
+        case OP_LESS_NUM:       *length = 1; return OP_LESS;
+#endif
+        default:
+            *length = instruction_length(chunk, offset);
+            return op;
+    }
+}
+
+void jit_compile(VM *vm, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Buffer buf = {vm, NULL, 0, 0};
+    uint32_t *entries = (uint32_t *)malloc(sizeof(uint32_t)*chunk->count);
+    Fixup *fixups = (Fixup *)malloc(sizeof(Fixup)*chunk->count*2);
+    int fixup_count = 0;
+    if (entries == NULL || fixups == NULL) exit(1);
+    for (int i=0; i<chunk->count; i++) entries[i] = JIT_NO_ENTRY;
+
+    // push rbx; mov rbx, rdi; jmp rsi
+    emit(&buf, (const uint8_t []){0x53, 0x48, 0x89, 0xfb, 0xff, 0xe6}, 6);
+    // 所有helper返回非0时都从这里退出, eax就是JitStatus
+    int epilogue = buf.count;
+    emit(&buf, (const uint8_t []){0x5b, 0xc3}, 2);
+
+    bool ok = true;
+    for (int offset=0; offset<chunk->count && ok;) {
+        int length;
+        uint8_t op = base_opcode(chunk, offset, &length);
+        uint8_t *ip = chunk->code + offset + 1;
+        entries[offset] = buf.count;
+
+        switch (op) {
+            case OP_JUMP:
+            case OP_LOOP: {
+                uint16_t jump = (uint16_t)((ip[0] << 8) | ip[1]);
+                fixups[fixup_count].at = emit_jmp(&buf);
+                fixups[fixup_count++].target = op == OP_JUMP ? offset+3+jump : offset+3-jump;
+                break;
+            }
+#ifdef NAN_BOXING
+            case OP_JUMP_IF_FALSE: {
+                uint16_t jump = (uint16_t)((ip[0] << 8) | ip[1]);
+                int at[2];
+                emit_jump_if_false(&buf, at);
+                for (int i=0; i<2; i++) {
+                    fixups[fixup_count].at = at[i];
+                    fixups[fixup_count++].target = offset+3+jump;
+                }
+                break;
+            }
+            case OP_CONSTANT: {
+                Value constant = chunk->constants.values[ip[0]];
+                if (IS_OBJ(constant)) goto helper;
+                emit_push_value(&buf, constant);
+                break;
+            }
+            case OP_NIL:    emit_push_value(&buf, NIL_VAL);     break;
+            case OP_TRUE:   emit_push_value(&buf, TRUE_VAL);    break;
+            case OP_FALSE:  emit_push_value(&buf, FALSE_VAL);   break;
+            case OP_POP:        emit_pop(&buf);                 break;
+            case OP_GET_LOCAL:  emit_get_local(&buf, ip[0]);    break;
+            case OP_SET_LOCAL:  emit_set_local(&buf, ip[0]);    break;
+            case OP_ADD_NUM:
+            case OP_SUBTRACT_NUM:
+            case OP_MULTIPLY_NUM:
+            case OP_DIVIDE_NUM:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+                emit_number_op(&buf, op, ip, epilogue);
+                break;
+#else
+            case OP_JUMP_IF_FALSE: {
+                uint16_t jump = (uint16_t)((ip[0] << 8) | ip[1]);
+                emit_helper_call(&buf, jit_helpers[op], ip);
+                fixups[fixup_count].at = emit_jnz(&buf);
+                fixups[fixup_count++].target = offset+3+jump;
+                break;
+            }
+#endif
+            default:
+#ifdef NAN_BOXING
+            helper:
+#endif
+                if (jit_helpers[op] == NULL) {
+                    ok = false;
+                    break;
+                }
+                emit_helper_call(&buf, jit_helpers[op], ip);
+                patch_rel32(&buf, emit_jnz(&buf), epilogue);
+                break;
+        }
+        offset += length;
+    }
+
+    for (int i=0; i<fixup_count && ok; i++) {
+        int target = fixups[i].target;
+        if (target < 0 || target >= chunk->count || entries[target] == JIT_NO_ENTRY) ok = false;
+        else patch_rel32(&buf, fixups[i].at, entries[target]);
+    }
+    free(fixups);
+
+    uint8_t *code = MAP_FAILED;
+    if (ok) {
+        code = (uint8_t *)mmap(NULL, buf.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (code == MAP_FAILED) {
+        free(buf.code);
+        free(entries);
+        return;
+    }
+    memcpy(code, buf.code, buf.count);
+    free(buf.code);
+    if (mprotect(code, buf.count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, buf.count);
+        free(entries);
+        return;
+    }
+
+    JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = buf.count;
+    jit->entries = entries;
+    jit->count = chunk->count;
+    function->jit = jit;
+}
+
+JitStatus jit_enter(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    JitCode *jit = function->jit;
+    uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+    if (entry == JIT_NO_ENTRY) return JIT_NOT_ENTERED;
+    JitStatus (*native)(CallFrame *, uint8_t *) = (JitStatus (*)(CallFrame *, uint8_t *))(void *)jit->code;
+    return native(frame, jit->code + entry);
+}
+
+void jit_free(JitCode *jit)
+{
+    if (jit == NULL) return;
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#else
+
+void jit_compile(VM *vm, ObjFunction *function)
+{
+}
+
+JitStatus jit_enter(CallFrame *frame)
+{
+    return JIT_NOT_ENTERED;
+}
+
+void jit_free(JitCode *jit)
+{
+}
+
+#endif
+
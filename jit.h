@@ -0,0 +1,39 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "common.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT_SUPPORTED
+#endif
+
+#define JIT_THRESHOLD       (1000)
+
+typedef enum {
+    JIT_CONTINUE,
+    JIT_FRAME,
+    JIT_ERROR,
+    JIT_DONE,
+    JIT_NOT_ENTERED,
+}JitStatus;
+
+typedef JitStatus (*JitHelper)(VM *vm, CallFrame *frame, uint8_t *ip);
+
+typedef struct JitCode {
+    uint8_t *code;
+    size_t size;
+    uint32_t *entries;
+    int count;
+}JitCode;
+
+extern JitHelper jit_helpers[UINT8_COUNT];
+
+void jit_compile(VM *vm, ObjFunction *function);
+
+JitStatus jit_enter(CallFrame *frame);
+
+void jit_free(JitCode *jit);
+
+#endif
+
@@ -1,16 +1,35 @@
-
 #include "vm.h"
+#include "memory.h"
+#include "compiler.h"
+#include "serialize.h"
+#include "code_cache.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+
+//gcc *.c -o test -lpthread
+
+#define RUN_READ_ERROR      (-1)
 
-//gcc *.c -o test
+// --no-cache关闭编译缓存, 启动后只读, 批处理线程可以共享
+static bool use_cache = true;
+// --gc=full关闭分代GC, 每次都回收整个堆
+static bool generational = true;
+// --gc-pause=US: full GC每步标记的时间上限, 0表示一次做完
+static int gc_pause = GC_PAUSE_US;
+// --gc-threads=N: full GC标记用的线程数, 0表示CPU核数
+static int gc_threads = GC_THREADS;
+// --gc=concurrent: full GC的标记在后台线程里和脚本同时进行
+static bool gc_concurrent = false;
 
-static void run_prompt()
+static void run_prompt(VM *vm)
 {
     char line[1024] = {0};
     while (1) {
         printf("> ");
         if (!fgets(line, sizeof(line), stdin))
             break;
-        InterpretResult result = interpret(line);
+        InterpretResult result = interpret(vm, line);
         if (result == INTERPRET_COMPILE_ERROR)
             printf("compile error!\n");
         else if (result == INTERPRET_RUNTIME_ERROR)
@@ -18,11 +37,11 @@ static void run_prompt()
     }
 }
 
-static char *read_file(const char *file)
+static char *read_file(FILE *out, const char *file, size_t *size)
 {
     FILE *fp = fopen(file, "rb");
     if (fp == NULL) {
-        printf("Could not open file %s\n", file);
+        fprintf(out, "Could not open file %s\n", file);
         return NULL;
     }
     fseek(fp, 0, SEEK_END);
@@ -30,46 +49,332 @@ static char *read_file(const char *file)
     rewind(fp);
     char *buf = (char *)malloc(file_size+1);
     if (buf == NULL) {
-        printf("Not enough memory to read %s\n", file);
+        fprintf(out, "Not enough memory to read %s\n", file);
         fclose(fp);
         return NULL;
     }
     int r = fread(buf, 1, file_size, fp);
     if (r != file_size) {
-        printf("Could not read file %s\n", file);
+        fprintf(out, "Could not read file %s\n", file);
         free(buf);
         fclose(fp);
         return NULL;
     }
     buf[file_size] = 0;
     fclose(fp);
+    if (size != NULL)
+        *size = file_size;
     return buf;
 }
 
-static void run_file(const char *file)
+static int run_file(VM *vm, const char *file)
 {
-    char *source = read_file(file);
-    if (source == NULL)
-        return;
-    printf("======== run: %s ========\n", file);
-    InterpretResult result = interpret(source);
+    // .loxc映射进内存直接使用, 其他文件才读入
+    Image *image = open_image(file);
+    char *source = NULL;
+    size_t size = 0;
+    if (image == NULL && (source = read_file(vm->out, file, &size)) == NULL)
+        return RUN_READ_ERROR;
+    fprintf(vm->out, "======== run: %s ========\n", file);
+    ObjFunction *function;
+    if (image != NULL || is_bytecode(source, size)) {
+        // 字节码跳过扫描和编译
+        function = image != NULL ? load_image(vm, image) : load_bytecode(vm, source, size, false);
+        if (function == NULL)
+            fprintf(vm->err, "Invalid or incompatible bytecode file %s\n", file);
+    }
+    else {
+        // 按源码哈希查找编译缓存, 未命中时编译并写回
+        char path[CODE_CACHE_PATH_MAX];
+        bool cached = use_cache && code_cache_path(path, sizeof(path), source, size);
+        function = cached ? load_code_cache(vm, path) : NULL;
+        if (function == NULL) {
+            function = compile(vm, source);
+            if (function != NULL && cached)
+                save_code_cache(vm, function, path);
+        }
+    }
     free(source);
+    InterpretResult result = function != NULL ? interpret_function(vm, function) : INTERPRET_COMPILE_ERROR;
     if (result == INTERPRET_COMPILE_ERROR)
-        printf("compile error!\n");
+        fprintf(vm->out, "compile error!\n");
     else if (result == INTERPRET_RUNTIME_ERROR)
-        printf("runtime error!\n");
+        fprintf(vm->out, "runtime error!\n");
+    return result;
+}
+
+// 编译成同名的.loxc文件, 不运行
+static int compile_file(VM *vm, const char *file)
+{
+    char *source = read_file(stderr, file, NULL);
+    if (source == NULL)
+        return RUN_READ_ERROR;
+    ObjFunction *function = compile(vm, source);
+    free(source);
+    if (function == NULL) {
+        fprintf(stderr, "compile error!\n");
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    const char *dot = strrchr(file, '.');
+    const char *slash = strrchr(file, '/');
+    size_t base = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t)(dot - file) : strlen(file);
+    char *path = (char *)malloc(base + 6);
+    if (path == NULL) exit(1);
+    memcpy(path, file, base);
+    strcpy(path + base, ".loxc");
+
+    int status = INTERPRET_OK;
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || !save_bytecode(vm, function, fp)) {
+        fprintf(stderr, "Could not write %s\n", path);
+        status = RUN_READ_ERROR;
+    }
+    if (fp != NULL && fclose(fp) != 0 && status == INTERPRET_OK) {
+        fprintf(stderr, "Could not write %s\n", path);
+        status = RUN_READ_ERROR;
+    }
+    free(path);
+    return status;
+}
+
+// 并行批处理: 每个脚本在独立的VM里运行, 输出先写到内存, 再按参数顺序打印
+typedef struct {
+    const char *file;
+    char *out;
+    size_t out_size;
+    char *err;
+    size_t err_size;
+    int status;
+    bool done;
+}Job;
+
+typedef struct {
+    Job *jobs;
+    int count;
+    int next;
+    bool jit;
+#ifdef DEBUG_OPCODE_STATS
+    OpStats *stats;
+#endif
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+}JobQueue;
+
+static void *batch_worker(void *arg)
+{
+    JobQueue *queue = (JobQueue *)arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count)
+            break;
+
+        Job *job = &queue->jobs[index];
+        FILE *out = open_memstream(&job->out, &job->out_size);
+        FILE *err = open_memstream(&job->err, &job->err_size);
+        VM vm;
+        init_vm(&vm);
+        vm.jit = queue->jit;
+        vm.generational = generational;
+        vm.gcPauseUs = gc_pause;
+        vm.gcThreads = gc_threads;
+        vm.gcConcurrent = gc_concurrent;
+        vm.out = out != NULL ? out : stdout;
+        vm.err = err != NULL ? err : stderr;
+        job->status = run_file(&vm, job->file);
+#ifdef DEBUG_OPCODE_STATS
+        pthread_mutex_lock(&queue->lock);
+        merge_op_stats(queue->stats, vm.stats);
+        pthread_mutex_unlock(&queue->lock);
+#endif
+        free_vm(&vm);
+        if (out != NULL) fclose(out);
+        if (err != NULL) fclose(err);
+
+        pthread_mutex_lock(&queue->lock);
+        job->done = true;
+        pthread_cond_broadcast(&queue->finished);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_batch(const char **files, int count, int workers, bool jit, bool json)
+{
+    JobQueue queue;
+    queue.jobs = (Job *)calloc(count, sizeof(Job));
+    if (queue.jobs == NULL) {
+        fprintf(stderr, "Not enough memory for %d jobs\n", count);
+        return 1;
+    }
+    for (int i=0; i<count; i++)
+        queue.jobs[i].file = files[i];
+    queue.count = count;
+    queue.next = 0;
+    queue.jit = jit;
+#ifdef DEBUG_OPCODE_STATS
+    queue.stats = new_op_stats();
+#endif
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.finished, NULL);
+
+    if (workers > count) workers = count;
+    double start = now();
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t)*workers);
+    if (threads == NULL) exit(1);
+    int started = 0;
+    for (; started<workers; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &queue) != 0)
+            break;
+    }
+    if (started == 0)
+        batch_worker(&queue);
+
+    int ok = 0, compile_errors = 0, runtime_errors = 0, read_errors = 0;
+    for (int i=0; i<count; i++) {
+        Job *job = &queue.jobs[i];
+        pthread_mutex_lock(&queue.lock);
+        while (!job->done)
+            pthread_cond_wait(&queue.finished, &queue.lock);
+        pthread_mutex_unlock(&queue.lock);
+
+        if (job->out != NULL) fwrite(job->out, 1, job->out_size, stdout);
+        if (job->err != NULL) fwrite(job->err, 1, job->err_size, stderr);
+        free(job->out);
+        free(job->err);
+        switch (job->status) {
+            case INTERPRET_OK: ok++; break;
+            case INTERPRET_COMPILE_ERROR: compile_errors++; break;
+            case INTERPRET_RUNTIME_ERROR: runtime_errors++; break;
+            default: read_errors++; break;
+        }
+    }
+    for (int i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    fflush(stdout);
+    fprintf(stderr, "======== batch: %d scripts, %d ok, %d compile errors, %d runtime errors, %d unreadable ========\n",
+            count, ok, compile_errors, runtime_errors, read_errors);
+    fprintf(stderr, "======== %d workers, %.3f s, %.1f scripts/s ========\n",
+            started > 0 ? started : 1, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+#ifdef DEBUG_OPCODE_STATS
+    report_op_stats(stderr, queue.stats, json);
+    free_op_stats(queue.stats);
+#endif
+
+    free(threads);
+    free(queue.jobs);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.finished);
+    return ok == count ? 0 : 1;
 }
 
 int main(int argc, char **argv)
 {
-    init_vm();
-    if (argc == 1)
-        run_prompt();
+    bool jit = false;
+    bool json = false;
+    bool stats = false;
+    bool compile_only = false;
+    const char *profile = NULL;
+    bool profile_lines = false;
+    int workers = 0;
+    int count = 0;
+    const char **files = (const char **)malloc(sizeof(char *)*argc);
+    if (files == NULL) exit(1);
+    // 写已关闭的管道时让write返回错误而不是结束进程
+    signal(SIGPIPE, SIG_IGN);
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0)
+            jit = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = true;
+        else if (strcmp(argv[i], "--compile") == 0)
+            compile_only = true;
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            use_cache = false;
+        else if (strcmp(argv[i], "--gc=full") == 0)
+            generational = false;
+        else if (strcmp(argv[i], "--gc=concurrent") == 0)
+            gc_concurrent = true;
+        else if (strncmp(argv[i], "--gc-pause=", 11) == 0)
+            gc_pause = atoi(argv[i]+11);
+        else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            gc_threads = atoi(argv[i]+13);
+            if (gc_threads <= 0)
+                gc_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (gc_threads <= 0)
+                gc_threads = 1;
+        }
+        else if (strcmp(argv[i], "--opstats=json") == 0)
+            json = true;
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+            profile = argv[i]+10;
+        else if (strncmp(argv[i], "--profile-lines=", 16) == 0) {
+            profile = argv[i]+16;
+            profile_lines = true;
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0) {
+            workers = atoi(argv[i]+2);
+            if (workers <= 0)
+                workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (workers <= 0)
+                workers = 1;
+        }
+        else
+            files[count++] = argv[i];
+    }
+
+    int status = 0;
+    if (compile_only) {
+        VM vm;
+        init_vm(&vm);
+        for (int i=0; i<count; i++) {
+            if (compile_file(&vm, files[i]) != INTERPRET_OK)
+                status = 1;
+        }
+        free_vm(&vm);
+    }
+    else if (workers > 0 && count > 0) {
+        if (profile != NULL)
+            fprintf(stderr, "Profiling is not supported in batch mode\n");
+        status = run_batch(files, count, workers, jit, json);
+    }
     else {
-        for (int i=1; i<argc; i++)
-            run_file(argv[i]);
+        VM vm;
+        init_vm(&vm);
+        vm.jit = jit;
+        vm.generational = generational;
+        vm.gcPauseUs = gc_pause;
+        vm.gcThreads = gc_threads;
+        vm.gcConcurrent = gc_concurrent;
+        if (profile != NULL && !start_profiler(&vm, profile, profile_lines))
+            fprintf(stderr, "Could not start profiler\n");
+        double start = now();
+        if (count == 0)
+            run_prompt(&vm);
+        else {
+            for (int i=0; i<count; i++)
+                run_file(&vm, files[i]);
+        }
+#ifdef DEBUG_OPCODE_STATS
+        report_op_stats(stderr, vm.stats, json);
+#endif
+        stop_profiler(&vm);
+        if (stats)
+            fprintf(stderr, "======== stats: %zu peak bytes, %d collections (%d minor), max pause %.3f ms, %.6f s ========\n",
+                    vm.peakBytes, vm.gcCount, vm.minorCount, vm.maxPauseUs / 1000, now() - start);
+        free_vm(&vm);
     }
-    free_vm();
-    return 0;
+    free(files);
+    return status;
 }
-
@@ -2,25 +2,59 @@
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "obj_fiber.h"
+#include "profiler.h"
+#include "parallel_mark.h"
+#include "concurrent_mark.h"
+#include <float.h>
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size)
+static void startCollection(VM *vm);
+static void markStep(VM *vm);
+static void sweepStep(VM *vm);
+
+void *reallocate(VM *vm, void *ptr, size_t old_size, size_t new_size)
 {
-    vm.bytesAllocated += new_size - old_size;
+    vm->bytesAllocated += new_size - old_size;
+    if (vm->bytesAllocated > vm->peakBytes) vm->peakBytes = vm->bytesAllocated;
 
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+    // 分代模式下每次分配都做minor GC, 偶尔做一次full GC; 增量标记时每次分配走一步.
+    // 并发标记时让后台线程去做
+    if (!vm->concurrentMarking) {
+      if (vm->marking) {
+        markStep(vm);
+      } else {
+        if (vm->sweeping) sweepStep(vm);
+        if (vm->generational && vm->gcCount % 8 != 7)
+          collect_young(vm);
+        else
+          startCollection(vm);
+      }
+    }
 #endif
-  }
 
-  if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
+    if (vm->concurrentMarking) {
+      // 后台线程标记完了就结束这一轮, 分配比标记快时不再等
+      if (marker_idle(vm) || vm->bytesAllocated > vm->gcStartBytes * GC_HEAP_GROW_FACTOR)
+        collectGarbage(vm);
+    } else if (vm->marking) {
+      if (vm->bytesAllocated > vm->nextStep) markStep(vm);
+    } else if (vm->sweeping && vm->bytesAllocated > vm->nextStep) {
+      sweepStep(vm);
+    } else if (!vm->generational) {
+      if (vm->bytesAllocated > vm->nextGC) startCollection(vm);
+    } else if (vm->bytesAllocated > vm->nurseryStart + GC_NURSERY_SIZE) {
+      // minor GC之后剩下的基本都是老年代, 老年代超过阈值才做full GC
+      collect_young(vm);
+      if (vm->bytesAllocated > vm->nextGC) startCollection(vm);
     }
+  }
 
     if (new_size == 0) {
         free(ptr);
@@ -32,59 +66,72 @@ void *reallocate(void *ptr, size_t old_size, size_t new_size)
     return result;
 }
 
-static void markRoots() {
-  for (Value* slot = vm.stack; slot < vm.top; slot++) {
-    markValue(*slot);
+static void markArray(VM *vm, ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+static void markRoots(VM *vm) {
+  for (Value* slot = vm->stack; slot < vm->top; slot++) {
+    markValue(vm, *slot);
   }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*)vm->frames[i].closure);
   }
 
-  for (ObjUpvalue* upvalue = vm.openUpvalues;
+  for (ObjUpvalue* upvalue = vm->openUpvalues;
        upvalue != NULL;
        upvalue = upvalue->next) {
-    markObject((Obj*)upvalue);
+    markObject(vm, (Obj*)upvalue);
+  }
+
+  markTable(vm, &vm->globalSlots);
+  markArray(vm, &vm->globalNames);
+  markArray(vm, &vm->globalValues);
+
+  markCompilerRoots(vm);
+  markObject(vm, (Obj*)vm->initString);
+  markObject(vm, (Obj*)vm->rootShape);
+  markObject(vm, (Obj*)vm->fiber);
+  markObject(vm, (Obj*)vm->rootFiber);
+  mark_loop(vm, &vm->loop);
+}
+
+void pushGray(VM *vm, Obj* object) {
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Obj**)realloc(vm->grayStack,
+                                  sizeof(Obj*) * vm->grayCapacity);
+    if (vm->grayStack == NULL) exit(1);
   }
 
-  markTable(&vm.globals);
 
-  markCompilerRoots();
-  markObject((Obj*)vm.initString);
+  vm->grayStack[vm->grayCount++] = object;
 }
 
-void markObject(Obj* object) {
+void markObject(VM *vm, Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
+  if (mark_worker != NULL) {
+    worker_mark(mark_worker, object);
+    return;
+  }
+  if (IS_MARKED(vm, object)) return;
   #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
   print_value(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
-
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj**)realloc(vm.grayStack,
-                                  sizeof(Obj*) * vm.grayCapacity);
-    if (vm.grayStack == NULL) exit(1);
-  }
-
-
-  vm.grayStack[vm.grayCount++] = object;
-}
-
-void markValue(Value value) {
-  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+  object->mark = vm->markEpoch;
+  pushGray(vm, object);
 }
 
-static void markArray(ValueArray* array) {
-  for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i]);
-  }
+void markValue(VM *vm, Value value) {
+  if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-static void blackenObject(Obj* object) {
+void blackenObject(VM *vm, Obj* object) {
     #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
   print_value(OBJ_VAL(object));
@@ -93,38 +140,77 @@ static void blackenObject(Obj* object) {
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
-      markValue(bound->receiver);
-      markObject((Obj*)bound->method);
+      markValue(vm, bound->receiver);
+      markObject(vm, (Obj*)bound->method);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      markObject((Obj*)instance->klass);
-      markTable(&instance->fields);
+      markObject(vm, (Obj*)instance->klass);
+      markObject(vm, (Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->slotCount; i++) {
+        markValue(vm, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      markObject(vm, (Obj*)fiber->closure);
+      markObject(vm, (Obj*)fiber->caller);
+      // 运行中的fiber栈由VM持有, 在markRoots里标记
+      if (fiber->stack == NULL) break;
+      for (Value* slot = fiber->stack; slot < fiber->top; slot++) {
+        markValue(vm, *slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        markObject(vm, (Obj*)fiber->frames[i].closure);
+      }
+      for (ObjUpvalue* upvalue = fiber->openUpvalues;
+           upvalue != NULL;
+           upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject(vm, (Obj*)shape->parent);
+      markObject(vm, (Obj*)shape->name);
+      markTable(vm, &shape->slots);
+      markTable(vm, &shape->transitions);
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      markObject((Obj*)klass->name);
-      markTable(&klass->methods);
+      markObject(vm, (Obj*)klass->name);
+      markTable(vm, &klass->methods);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      markObject((Obj*)closure->function);
+      markObject(vm, (Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markObject(vm, (Obj*)closure->upvalues[i]);
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);
-      markArray(&function->chunk.constants);
+      markObject(vm, (Obj*)function->name);
+      markArray(vm, &function->chunk.constants);
+      for (int i = 0; i < function->chunk.cache_count; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+          markObject(vm, (Obj*)cache->entries[j].klass);
+          markObject(vm, (Obj*)cache->entries[j].shape);
+          markObject(vm, (Obj*)cache->entries[j].transition);
+          markValue(vm, cache->entries[j].method);
+        }
+      }
       break;
     }
     case OBJ_UPVALUE:
-      markValue(((ObjUpvalue*)object)->closed);
+      markValue(vm, ((ObjUpvalue*)object)->closed);
       break;
     case OBJ_NATIVE:
     case OBJ_STRING:
@@ -132,57 +218,304 @@ static void blackenObject(Obj* object) {
   }
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
-    Obj* object = vm.grayStack[--vm.grayCount];
-    blackenObject(object);
+static void traceReferences(VM *vm) {
+  while (vm->grayCount > 0) {
+    Obj* object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
+  }
+}
+
+static bool parallelMarking(VM *vm) {
+  return vm->gcThreads > 1 && vm->bytesAllocated >= GC_PARALLEL_MIN_HEAP;
+}
+
+static void rememberObject(VM *vm, Obj *object) {
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Obj**)realloc(vm->remembered,
+                                    sizeof(Obj*) * vm->rememberedCapacity);
+    if (vm->remembered == NULL) exit(1);
   }
+  object->isRemembered = true;
+  vm->remembered[vm->rememberedCount++] = object;
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
+// WRITE_BARRIER的慢路径, child为NULL表示owner被批量改写
+void write_barrier(VM *vm, Obj *owner, Obj *child) {
+  if (owner->isOld && !owner->isRemembered && (child == NULL || !child->isOld)) {
+    rememberObject(vm, owner);
+  }
+  if (vm->marking && IS_MARKED(vm, owner)) {
+    if (child != NULL) {
+      markObject(vm, child);
+    } else {
+      pushGray(vm, owner);
+    }
+  }
+}
+
+// 老对象在两次full GC之间一直是已标记的, 所以minor GC的标记到老对象就停下,
+// 只有remembered set里的老对象要重新扫描它们的引用
+static void markRemembered(VM *vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    Obj* object = vm->remembered[i];
+    object->isRemembered = false;
+    blackenObject(vm, object);
+  }
+  vm->rememberedCount = 0;
+}
+
+static void forgetRemembered(VM *vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+}
+
+// 释放没标记的新生代对象, 活下来的保持标记移进老年代
+static void sweepYoung(VM *vm) {
+  Obj* object = vm->young;
+  vm->young = NULL;
   while (object != NULL) {
-    if (object->isMarked) {
-        object->isMarked = false;
-      previous = object;
-      object = object->next;
+    Obj* next = object->next;
+    if (IS_MARKED(vm, object)) {
+      object->isOld = true;
+      object->next = vm->objects;
+      vm->objects = object;
     } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
+      freeObject(vm, object);
+    }
+    object = next;
+  }
+}
+
+static double nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void notePause(VM *vm, double start) {
+    double pause = nowUs() - start;
+    if (pause > vm->maxPauseUs) vm->maxPauseUs = pause;
+}
+
+#define GC_STEP_BATCH   (64)
+
+// 惰性清除: 从unswept链表取对象, 没标记的释放, 标记的放回vm->objects.
+// 先清新生代, minor GC之前它必须清完
+static void sweepBatch(VM *vm) {
+    for (int i = 0; i < GC_STEP_BATCH; i++) {
+      bool young = vm->unsweptYoung != NULL;
+      Obj** list = young ? &vm->unsweptYoung : &vm->unsweptOld;
+      Obj* object = *list;
+      if (object == NULL) {
+        vm->sweeping = false;
+        vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+        printf("-- sweep end\n");
+        printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+               vm->gcStartBytes - vm->bytesAllocated, vm->gcStartBytes, vm->bytesAllocated,
+               vm->nextGC);
+#endif
+        return;
       }
+      *list = object->next;
 
-      freeObject(unreached);
+      if (!IS_MARKED(vm, object)) {
+        freeObject(vm, object);
+        continue;
+      }
+      if (young && vm->generational) {
+        object->isOld = true;
+        // 标记完到晋升之间写进来的新生代对象没被记下来
+        if (object->type != OBJ_STRING && !object->isRemembered)
+          rememberObject(vm, object);
+      }
+      object->next = vm->objects;
+      vm->objects = object;
     }
-  }
 }
 
-void collectGarbage() {
+// 清除释放的是上次full GC之前分配的对象, 不算进新生代的分配量
+static void sweepUntil(VM *vm, double deadline) {
+    size_t before = vm->bytesAllocated;
+    do {
+      sweepBatch(vm);
+    } while (vm->sweeping && nowUs() < deadline);
+    size_t freed = before - vm->bytesAllocated;
+    vm->nurseryStart = vm->nurseryStart > freed ? vm->nurseryStart - freed : 0;
+}
+
+static void finishSweep(VM *vm) {
+    if (vm->sweeping) sweepUntil(vm, DBL_MAX);
+}
+
+static void sweepStep(VM *vm) {
+    double start = nowUs();
+#ifdef DEBUG_STRESS_GC
+    sweepUntil(vm, 0);
+#else
+    sweepUntil(vm, start + vm->gcPauseUs);
+#endif
+    vm->nextStep = vm->bytesAllocated + GC_STEP_SIZE;
+    notePause(vm, start);
+}
+
+// 只回收新生代: 根和remembered set里的老对象是起点, 活下来的新生代对象全部晋升
+void collect_young(VM *vm) {
+  // 增量标记进行中时老年代的标记位不是粘性的, 等full GC结束
+  if (vm->marking || vm->concurrentMarking) return;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    double start = nowUs();
+    if (vm->profiler != NULL) flush_profiler(vm->profiler);
+    vm->gcCount++;
+    vm->minorCount++;
+
+    // 上次full GC活下来但还没清除的新生代对象没有经过老年代的写屏障, 先晋升并记进remembered set
+    while (vm->unsweptYoung != NULL) sweepBatch(vm);
+
+    markRoots(vm);
+    markRemembered(vm);
+    traceReferences(vm);
+
+    tableRemoveWhite(vm, &vm->strings);
+
+    sweepYoung(vm);
+
+    vm->nurseryStart = vm->bytesAllocated;
+    notePause(vm, start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+
+// full GC的开始: 换一个markEpoch让所有对象变成未标记, 标记根. 之后的标记可以分步做
+static void beginMarking(VM *vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
+    vm->gcCount++;
+    vm->gcStartBytes = vm->bytesAllocated;
+    vm->gcRequested = false;
 
+    // 换markEpoch之后分不清还没清除的对象是死是活
+    finishSweep(vm);
+    vm->markEpoch = vm->markEpoch == UINT8_MAX ? 1 : vm->markEpoch + 1;
+    forgetRemembered(vm);
 
-    markRoots();
-    traceReferences();
+    markRoots(vm);
+}
+
+// 根在标记期间没有写屏障, 最后重新标记一次再清除
+static void finishCollection(VM *vm) {
+    if (vm->concurrentMarking) {
+      stop_marker(vm);
+      vm->concurrentMarking = false;
+    }
+    markRoots(vm);
+    if (parallelMarking(vm)) {
+      parallel_trace(vm, DBL_MAX);
+    } else {
+      traceReferences(vm);
+    }
+    vm->marking = false;
 
-    tableRemoveWhite(&vm.strings);
+    // 采样里记录的函数可能被回收, 先转换成字符串
+    if (vm->profiler != NULL) flush_profiler(vm->profiler);
 
-    sweep();
+    tableRemoveWhite(vm, &vm->strings);
+    forgetRemembered(vm);
 
+    // 两个链表整个交给sweeper, 之后分配的对象进新的young链表, 不会被误清除
+    vm->unsweptOld = vm->objects;
+    vm->unsweptYoung = vm->young;
+    vm->objects = NULL;
+    vm->young = NULL;
+    vm->sweeping = true;
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // 清除完会按实际剩下的重新算
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nurseryStart = vm->bytesAllocated;
+    vm->nextStep = vm->bytesAllocated + GC_STEP_SIZE;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
 #endif
+    if (vm->gcPauseUs <= 0) finishSweep(vm);
 }
 
+// 处理gray stack直到用完gcPauseUs, 每GC_STEP_BATCH个对象看一次时间
+static void markStep(VM *vm) {
+    double start = nowUs();
+#ifdef DEBUG_STRESS_GC
+    // 每步只处理一批, 尽量多地和mutator交错
+    double deadline = 0;
+#else
+    double deadline = start + vm->gcPauseUs;
+#endif
+    if (parallelMarking(vm)) {
+      parallel_trace(vm, deadline);
+    } else {
+      do {
+        for (int i = 0; i < GC_STEP_BATCH && vm->grayCount > 0; i++) {
+          Obj* object = vm->grayStack[--vm->grayCount];
+          blackenObject(vm, object);
+        }
+      } while (vm->grayCount > 0 && nowUs() < deadline);
+    }
+
+    // 分配速度超过标记速度时不再等, 直接做完
+    if (vm->grayCount == 0 || vm->bytesAllocated > vm->gcStartBytes * GC_HEAP_GROW_FACTOR) {
+      finishCollection(vm);
+    } else {
+      vm->nextStep = vm->bytesAllocated + GC_STEP_SIZE;
+    }
+    notePause(vm, start);
+}
+
+static void startCollection(VM *vm) {
+    if (vm->gcConcurrent) {
+      // 等到下一个safepoint再开始, 一直等不到(比如JIT代码里的循环)就直接做完
+      vm->gcRequested = true;
+      if (vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR) collectGarbage(vm);
+      return;
+    }
+    if (vm->gcPauseUs <= 0) {
+      collectGarbage(vm);
+      return;
+    }
+    double start = nowUs();
+    beginMarking(vm);
+    vm->marking = true;
+    notePause(vm, start);
+    markStep(vm);
+}
+
+// 暂停mutator标记根, 之后的标记交给后台线程
+void gc_safepoint(VM *vm) {
+    double start = nowUs();
+    beginMarking(vm);
+    if (start_marker(vm)) {
+      vm->concurrentMarking = true;
+    } else {
+      finishCollection(vm);
+    }
+    notePause(vm, start);
+}
+
+// 一次做完的full GC, 增量标记进行中时把剩下的做完
+void collectGarbage(VM *vm) {
+    double start = nowUs();
+    if (!vm->marking && !vm->concurrentMarking) beginMarking(vm);
+    finishCollection(vm);
+    notePause(vm, start);
+}
@@ -4,25 +4,80 @@
 
 #include "common.h"
 #include "value.h"
+#include "concurrent_mark.h"
 
 #define GC_HEAP_GROW_FACTOR 2
+// 增量标记时每分配这么多字节做一步标记, 每步最多GC_PAUSE_US微秒(0表示不做增量标记)
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE        (64 * 1024)
+#endif
+#ifndef GC_PAUSE_US
+#define GC_PAUSE_US         (1000)
+#endif
+// full GC标记用的线程数(包括主线程), 堆小于GC_PARALLEL_MIN_HEAP时只用主线程
+#ifndef GC_THREADS
+#define GC_THREADS          (1)
+#endif
+#ifndef GC_PARALLEL_MIN_HEAP
+#define GC_PARALLEL_MIN_HEAP (4 * 1024 * 1024)
+#endif
+// 分配这么多字节后做一次只回收新生代的minor GC
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE     (1024 * 1024)
+#endif
 
-#define ALLOCATE(type)                  (type*)reallocate(NULL, 0, sizeof(type))
-#define FREE(type, ptr)                 reallocate(ptr, sizeof(type), 0)
+#define ALLOCATE(vm, type)              (type*)reallocate(vm, NULL, 0, sizeof(type))
+#define FREE(vm, type, ptr)             reallocate(vm, ptr, sizeof(type), 0)
 
-#define ALLOCATE_ARRAY(type, size)      (type*)reallocate(NULL, 0, sizeof(type)*(size))
-#define FREE_ARRAY(type, ptr, size)     reallocate(ptr, sizeof(type)*(size), 0)
+#define ALLOCATE_ARRAY(vm, type, size)  (type*)reallocate(vm, NULL, 0, sizeof(type)*(size))
+#define FREE_ARRAY(vm, type, ptr, size) reallocate(vm, ptr, sizeof(type)*(size), 0)
 
 #define GROW_CAPACITY(old)              ((old) < 8 ? 8 : (old)*2)
 
-#define GROW_ARRAY(type, ptr, old_capacity, new_capacity) \
-                                        (type*)reallocate(ptr, sizeof(type)*(old_capacity), sizeof(type)*(new_capacity))
+#define GROW_ARRAY(vm, type, ptr, old_capacity, new_capacity) \
+                                        (type*)reallocate(vm, ptr, sizeof(type)*(old_capacity), sizeof(type)*(new_capacity))
+
+void *reallocate(VM *vm, void *ptr, size_t old_size, size_t new_size);
+
+// 分代: 老对象里写入新生代对象后要记到remembered set, minor GC时把它当作根.
+// 增量标记: 已标记的对象里写入未标记的对象时把它标记上, 批量写入时把owner重新放回gray stack
+#define WRITE_BARRIER(vm, owner, value) \
+    do { if (IS_OBJ(value)) WRITE_BARRIER_OBJ(vm, owner, AS_OBJ(value)); } while (0)
+#define WRITE_BARRIER_OBJ(vm, owner, child) \
+    do { \
+        Obj *_owner = (Obj *)(owner), *_child = (Obj *)(child); \
+        if (_child != NULL && ((_owner->isOld && !_owner->isRemembered && !_child->isOld) || \
+                               ((vm)->marking && IS_MARKED(vm, _owner) && !IS_MARKED(vm, _child)))) \
+            write_barrier(vm, _owner, _child); \
+    } while (0)
+// 批量写入(复制表, 切换fiber栈)时不逐个检查, 直接记下owner
+#define REMEMBER_OBJ(vm, owner) \
+    do { \
+        Obj *_owner = (Obj *)(owner); \
+        if ((_owner->isOld && !_owner->isRemembered) || ((vm)->marking && IS_MARKED(vm, _owner))) \
+            write_barrier(vm, _owner, NULL); \
+    } while (0)
+
+// 并发标记(snapshot-at-the-beginning): 对象在这一轮第一次被改写之前由mutator先扫描,
+// 快照里它引用的对象都会被标记, 标记线程也不会读到改了一半的对象. 要放在改写之前
+#define SNAPSHOT_BARRIER(vm, owner) \
+    do { \
+        Obj *_owner = (Obj *)(owner); \
+        if ((vm)->concurrentMarking && !IS_SCANNED(vm, _owner)) snapshot_barrier(vm, _owner); \
+    } while (0)
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size);
+// 并发标记只在safepoint(指令边界)开始, 那里没有改了一半的对象
+#define GC_SAFEPOINT(vm) \
+    do { if ((vm)->gcRequested) gc_safepoint(vm); } while (0)
 
-void collectGarbage();
-void markValue(Value value);
-void markObject(Obj* object);
+void collectGarbage(VM *vm);
+void gc_safepoint(VM *vm);
+void collect_young(VM *vm);
+void write_barrier(VM *vm, Obj *owner, Obj *child);
+void markValue(VM *vm, Value value);
+void markObject(VM *vm, Obj* object);
+void pushGray(VM *vm, Obj* object);
+void blackenObject(VM *vm, Obj* object);
 
 #endif
 
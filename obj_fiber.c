@@ -0,0 +1,71 @@
+
+#include "obj_fiber.h"
+#include "memory.h"
+
+ObjFiber *new_fiber(VM *vm, ObjClosure *closure)
+{
+    ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackCapacity = 0;
+    fiber->top = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->state = FIBER_NEW;
+    if (closure == NULL) return fiber;
+
+    push(vm, OBJ_VAL(fiber));
+    fiber->frames = ALLOCATE_ARRAY(vm, CallFrame, FRAMES_INIT);
+    fiber->frameCapacity = FRAMES_INIT;
+    fiber->stack = ALLOCATE_ARRAY(vm, Value, STACK_INIT);
+    fiber->stackCapacity = STACK_INIT;
+    fiber->stack[0] = OBJ_VAL(closure);
+    WRITE_BARRIER_OBJ(vm, fiber, closure);
+    fiber->top = fiber->stack + 1;
+    pop(vm);
+    return fiber;
+}
+
+void fiber_save(VM *vm, ObjFiber *fiber)
+{
+    SNAPSHOT_BARRIER(vm, fiber);
+    fiber->frames = vm->frames;
+    fiber->frameCount = vm->frameCount;
+    fiber->frameCapacity = vm->frameCapacity;
+    fiber->stack = vm->stack;
+    fiber->stackCapacity = vm->stackCapacity;
+    fiber->top = vm->top;
+    fiber->openUpvalues = vm->openUpvalues;
+    REMEMBER_OBJ(vm, fiber);
+}
+
+void fiber_load(VM *vm, ObjFiber *fiber)
+{
+    PROFILE_PAUSE(vm);
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackCapacity = fiber->stackCapacity;
+    vm->top = fiber->top;
+    vm->openUpvalues = fiber->openUpvalues;
+    // 换上来的栈之后由mutator直接改写
+    SNAPSHOT_BARRIER(vm, fiber);
+    fiber->frames = NULL;
+    fiber->stack = NULL;
+    fiber->top = NULL;
+    fiber->openUpvalues = NULL;
+    vm->fiber = fiber;
+    PROFILE_RESUME(vm);
+}
+
+void free_fiber(VM *vm, ObjFiber *fiber)
+{
+    FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+    FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
+    FREE(vm, ObjFiber, fiber);
+}
+
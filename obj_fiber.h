@@ -0,0 +1,40 @@
+
+#ifndef _OBJ_FIBER_H_
+#define _OBJ_FIBER_H_
+
+#include "vm.h"
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,
+    FIBER_RESUMING,
+    FIBER_WAITING,
+    FIBER_DONE,
+}FiberState;
+
+// 正在运行的fiber的栈由VM持有, 挂起时才存回fiber
+typedef struct ObjFiber {
+    Obj obj;
+    ObjClosure *closure;
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
+    int stackCapacity;
+    Value *top;
+    ObjUpvalue *openUpvalues;
+    struct ObjFiber *caller;
+    FiberState state;
+}ObjFiber;
+
+ObjFiber *new_fiber(VM *vm, ObjClosure *closure);
+
+void fiber_save(VM *vm, ObjFiber *fiber);
+
+void fiber_load(VM *vm, ObjFiber *fiber);
+
+void free_fiber(VM *vm, ObjFiber *fiber);
+
+#endif
+
@@ -1,68 +1,155 @@
 
 #include "obj_function.h"
 #include "memory.h"
+#include "vm.h"
+#include "jit.h"
 
-ObjFunction *new_function()
+ObjFunction *new_function(VM *vm)
 {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->lazyStrings = NULL;
     init_chunk(&function->chunk);
     return function;
 }
 
-void free_function(ObjFunction *function)
+void free_function(VM *vm, ObjFunction *function)
 {
-    free_chunk(&function->chunk);
-    FREE(ObjFunction, function);
+    jit_free(function->jit);
+    if (function->lazyStrings != NULL)
+        FREE_ARRAY(vm, const char *, function->lazyStrings, function->chunk.constants.count);
+    free_chunk(vm, &function->chunk);
+    FREE(vm, ObjFunction, function);
 }
 
-ObjNative* newNative(NativeFn function) {
-  ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM *vm, NativeFn function) {
+  ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE_ARRAY(ObjUpvalue*,
+// chars以'\0'结尾, 在镜像里, 一直有效
+static void internLazyStrings(VM *vm, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  SNAPSHOT_BARRIER(vm, function);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    const char* chars = function->lazyStrings[i];
+    if (chars == NULL) continue;
+    Value value = OBJ_VAL(map_string(vm, chars, (int)strlen(chars)));
+    chunk->constants.values[i] = value;
+    WRITE_BARRIER(vm, function, value);
+  }
+  FREE_ARRAY(vm, const char *, function->lazyStrings, chunk->constants.count);
+  function->lazyStrings = NULL;
+}
+
+ObjClosure* newClosure(VM *vm, ObjFunction* function) {
+  if (function->lazyStrings != NULL) internLazyStrings(vm, function);
+  ObjUpvalue** upvalues = ALLOCATE_ARRAY(vm, ObjUpvalue*,
                                    function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
     upvalues[i] = NULL;
   }
 
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
   return closure;
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-  ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM *vm, Value* slot) {
+  ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
   upvalue->closed = NIL_VAL;
   upvalue->next = NULL;
   return upvalue;
 }
 
-ObjClass* newClass(ObjString* name) {
-  ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM *vm, ObjString* name) {
+  ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
   klass->name = name;
   init_table(&klass->methods);
+  klass->version = 0;
+  klass->slotHint = 0;
   return klass;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjShape* newShape(VM *vm, ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slotCount = 0;
+  init_table(&shape->slots);
+  init_table(&shape->transitions);
+  if (parent == NULL) return shape;
+
+  push(vm, OBJ_VAL(shape));
+  table_copy(vm, &parent->slots, &shape->slots);
+  shape->slotCount = parent->slotCount + 1;
+  table_set(vm, &shape->slots, name, NUMBER_VAL(parent->slotCount));
+  SNAPSHOT_BARRIER(vm, parent);
+  table_set(vm, &parent->transitions, name, OBJ_VAL(shape));
+  REMEMBER_OBJ(vm, shape);
+  WRITE_BARRIER_OBJ(vm, parent, shape);
+  pop(vm);
+  return shape;
+}
+
+ObjShape* shapeTransition(VM *vm, ObjShape* shape, ObjString* name) {
+  Value next;
+  if (table_get(&shape->transitions, name, &next)) {
+    return (ObjShape*)AS_OBJ(next);
+  }
+  return newShape(vm, shape, name);
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!table_get(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+ObjInstance* newInstance(VM *vm, ObjClass* klass) {
+  int capacity = klass->slotHint;
+  Value* fields = ALLOCATE_ARRAY(vm, Value, capacity);
+
+  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  init_table(&instance->fields);
+  instance->shape = vm->rootShape;
+  instance->capacity = capacity;
+  instance->fields = fields;
   return instance;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver,
+void instanceSetShape(VM *vm, ObjInstance* instance, ObjShape* shape) {
+  SNAPSHOT_BARRIER(vm, instance);
+  if (instance->capacity < shape->slotCount) {
+    int old_capacity = instance->capacity;
+    instance->capacity = old_capacity < 4 ? 4 : old_capacity * 2;
+    if (instance->capacity < shape->slotCount) {
+      instance->capacity = shape->slotCount;
+    }
+    instance->fields = GROW_ARRAY(vm, Value, instance->fields,
+                                  old_capacity, instance->capacity);
+  }
+  for (int i = instance->shape->slotCount; i < shape->slotCount; i++) {
+    instance->fields[i] = NIL_VAL;
+  }
+  instance->shape = shape;
+  WRITE_BARRIER_OBJ(vm, instance, shape);
+  if (instance->klass->slotHint < shape->slotCount) {
+    instance->klass->slotHint = shape->slotCount;
+  }
+}
+
+ObjBoundMethod* newBoundMethod(VM *vm, Value receiver,
                                ObjClosure* method) {
-  ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod,
+  ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod,
                                        OBJ_BOUND_METHOD);
   bound->receiver = receiver;
   bound->method = method;
@@ -13,6 +13,9 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+    int hotness;
+    struct JitCode *jit;
+    const char **lazyStrings;   // 映射加载的字符串常量, 第一次创建闭包时才驻留, 之前常量是nil
 }ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -29,16 +32,29 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
   Obj obj;
   ObjString* name;
   Table methods;
+  int version;
+  int slotHint;
 } ObjClass;
 
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+  ObjString* name;
+  int slotCount;
+  Table slots;
+  Table transitions;
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields;
+  ObjShape* shape;
+  int capacity;
+  Value* fields;
 } ObjInstance;
 
 typedef struct {
@@ -48,28 +64,37 @@ typedef struct {
 } ObjBoundMethod;
 
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// 结果写入args[-1], 出错时返回false
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
   Obj obj;
   NativeFn function;
 } ObjNative;
 
-ObjFunction *new_function();
+ObjFunction *new_function(VM *vm);
+
+void free_function(VM *vm, ObjFunction *function);
+
+ObjNative* newNative(VM *vm, NativeFn function);
+
+ObjClosure* newClosure(VM *vm, ObjFunction* function);
+
+ObjUpvalue* newUpvalue(VM *vm, Value* slot);
 
-void free_function(ObjFunction *function);
+ObjClass* newClass(VM *vm, ObjString* name);
 
-ObjNative* newNative(NativeFn function);
+ObjShape* newShape(VM *vm, ObjShape* parent, ObjString* name);
 
-ObjClosure* newClosure(ObjFunction* function);
+ObjShape* shapeTransition(VM *vm, ObjShape* shape, ObjString* name);
 
-ObjUpvalue* newUpvalue(Value* slot);
+int shapeSlot(ObjShape* shape, ObjString* name);
 
-ObjClass* newClass(ObjString* name);
+ObjInstance* newInstance(VM *vm, ObjClass* klass);
 
-ObjInstance* newInstance(ObjClass* klass);
+void instanceSetShape(VM *vm, ObjInstance* instance, ObjShape* shape);
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjBoundMethod* newBoundMethod(VM *vm, Value receiver, ObjClosure* method);
 
 #endif
 
@@ -2,6 +2,7 @@
 #include "obj_string.h"
 #include "memory.h"
 #include "vm.h"
+#include "concurrent_mark.h"
 
 static uint32_t hash_string(const char *str, int length)
 {
@@ -13,43 +14,64 @@ static uint32_t hash_string(const char *str, int length)
     return hash;
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash)
+static ObjString *allocate_string(VM *vm, char *chars, int length, uint32_t hash)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->chars = chars;
     string->length = length;
     string->hash = hash;
-    push(OBJ_VAL(string));
-    table_set(&vm.strings, string, NIL_VAL);
-    pop();
+    string->mapped = false;
+    push(vm, OBJ_VAL(string));
+    table_set(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 
-ObjString *copy_string(const char *src, int length)
+// 驻留表是弱引用, 并发标记时从里面拿到的字符串可能不在快照里, 要标记上
+static ObjString *internedString(VM *vm, ObjString *string)
+{
+    if (vm->concurrentMarking && !IS_MARKED(vm, (Obj *)string))
+        shade_object(vm, (Obj *)string);
+    return string;
+}
+
+ObjString *copy_string(VM *vm, const char *src, int length)
 {
     uint32_t hash = hash_string(src, length);
-    ObjString *interned = table_find_string(&vm.strings, src, length, hash);
-    if (interned != NULL) return interned;
-    char *chars = ALLOCATE_ARRAY(char, length+1);
+    ObjString *interned = table_find_string(&vm->strings, src, length, hash);
+    if (interned != NULL) return internedString(vm, interned);
+    char *chars = ALLOCATE_ARRAY(vm, char, length+1);
     memcpy(chars, src, length);
     chars[length] = 0;
-    return allocate_string(chars, length, hash);
+    return allocate_string(vm, chars, length, hash);
 }
 
-ObjString *take_string(char *chars, int length)
+ObjString *take_string(VM *vm, char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length+1);
-        return interned;
+        FREE_ARRAY(vm, char, chars, length+1);
+        return internedString(vm, interned);
     }
-    return allocate_string(chars, length, hash);
+    return allocate_string(vm, chars, length, hash);
+}
+
+// chars以'\0'结尾且比字符串活得久(镜像在free_vm时才解除映射), 不复制
+ObjString *map_string(VM *vm, const char *chars, int length)
+{
+    uint32_t hash = hash_string(chars, length);
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
+    if (interned != NULL) return internedString(vm, interned);
+    ObjString *string = allocate_string(vm, (char *)chars, length, hash);
+    string->mapped = true;
+    return string;
 }
 
-void free_string(ObjString *string)
+void free_string(VM *vm, ObjString *string)
 {
-    FREE_ARRAY(char, string->chars, string->length+1);
-    FREE(ObjString, string);
+    if (!string->mapped)
+        FREE_ARRAY(vm, char, string->chars, string->length+1);
+    FREE(vm, ObjString, string);
 }
 
@@ -9,13 +9,16 @@ typedef struct {
     int length;
     char *chars;
     uint32_t hash;
+    bool mapped;        // chars指向映射的镜像
 }ObjString;
 
-ObjString *copy_string(const char *src, int length);
+ObjString *copy_string(VM *vm, const char *src, int length);
 
-ObjString *take_string(char *chars, int length);
+ObjString *take_string(VM *vm, char *chars, int length);
 
-void free_string(ObjString *string);
+ObjString *map_string(VM *vm, const char *chars, int length);
+
+void free_string(VM *vm, ObjString *string);
 
 #endif
 
@@ -3,13 +3,17 @@
 #include "memory.h"
 #include "vm.h"
 
-Obj *allocate_object(size_t size, ObjType type)
+Obj *allocate_object(VM *vm, size_t size, ObjType type)
 {
-    Obj *obj = (Obj *)reallocate(NULL, 0, size);
+    Obj *obj = (Obj *)reallocate(vm, NULL, 0, size);
     obj->type = type;
-    obj->isMarked = false;
-    obj->next = vm.objects;
-    vm.objects = obj;
+    // 并发标记期间分配的对象直接是黑色, 标记线程不会读到还在初始化的对象
+    obj->mark = vm->concurrentMarking ? vm->markEpoch : 0;
+    obj->scanned = obj->mark;
+    obj->isOld = false;
+    obj->isRemembered = false;
+    obj->next = vm->young;
+    vm->young = obj;
     #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)obj, size, type);
 #endif
@@ -13,17 +13,27 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_FIBER,
 }ObjType;
 
 typedef struct Obj {
     ObjType type;
-    bool isMarked;
+    uint8_t mark;           // 等于vm->markEpoch时是已标记的, 新对象是0
+    bool isOld;             // 分代模式下已晋升到老年代, 标记位在minor GC之间保持
+    bool isRemembered;      // 在remembered set里
+    uint8_t scanned;        // 并发标记时等于vm->markEpoch表示这一轮已经扫描过
     struct Obj *next;
 }Obj;
 
-#define ALLOCATE_OBJ(type, obj_type)        (type*)allocate_object(sizeof(type), obj_type)
+// 每次full GC开始时markEpoch加一, 所有对象一下子都变成未标记, 不用遍历堆去清标记
+#define IS_MARKED(vm, object)               ((object)->mark == (vm)->markEpoch)
+// 标记线程扫描完才设置, mutator不拿锁读
+#define IS_SCANNED(vm, object)              (__atomic_load_n(&(object)->scanned, __ATOMIC_ACQUIRE) == (vm)->markEpoch)
 
-Obj *allocate_object(size_t size, ObjType type);
+#define ALLOCATE_OBJ(vm, type, obj_type)    (type*)allocate_object(vm, sizeof(type), obj_type)
+
+Obj *allocate_object(VM *vm, size_t size, ObjType type);
 
 #endif
 
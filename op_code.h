@@ -40,6 +40,21 @@ typedef enum {
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
     OP_RETURN,
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
+
+    OP_ADD_LOCAL_LOCAL,             // OP_GET_LOCAL a; OP_GET_LOCAL b; OP_ADD
+    OP_LESS_LOCAL_CONSTANT_JUMP,    // OP_GET_LOCAL a; OP_CONSTANT k; OP_LESS; OP_JUMP_IF_FALSE; OP_POP
+    OP_GET_PROPERTY_SET_LOCAL,      // OP_GET_PROPERTY k c; OP_SET_LOCAL a
+
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
 }OpCode;
 
 #endif
@@ -0,0 +1,167 @@
+
+#include "op_stats.h"
+
+#ifdef DEBUG_OPCODE_STATS
+
+#include "op_code.h"
+
+static const char *op_names[UINT8_COUNT] = {
+    [OP_CONSTANT]       = "OP_CONSTANT",
+    [OP_NIL]            = "OP_NIL",
+    [OP_FALSE]          = "OP_FALSE",
+    [OP_TRUE]           = "OP_TRUE",
+    [OP_NOT]            = "OP_NOT",
+    [OP_NEGATE]         = "OP_NEGATE",
+    [OP_EQUAL]          = "OP_EQUAL",
+    [OP_GREATER]        = "OP_GREATER",
+    [OP_LESS]           = "OP_LESS",
+    [OP_ADD]            = "OP_ADD",
+    [OP_SUBTRACT]       = "OP_SUBTRACT",
+    [OP_MULTIPLY]       = "OP_MULTIPLY",
+    [OP_DIVIDE]         = "OP_DIVIDE",
+    [OP_PRINT]          = "OP_PRINT",
+    [OP_POP]            = "OP_POP",
+    [OP_DEFINE_GLOBAL]  = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL]     = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL]     = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL]      = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]      = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE]    = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]    = "OP_SET_UPVALUE",
+    [OP_JUMP]           = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]  = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]           = "OP_LOOP",
+    [OP_CALL]           = "OP_CALL",
+    [OP_CLOSURE]        = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE]  = "OP_CLOSE_UPVALUE",
+    [OP_CLASS]          = "OP_CLASS",
+    [OP_GET_PROPERTY]   = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]   = "OP_SET_PROPERTY",
+    [OP_METHOD]         = "OP_METHOD",
+    [OP_INVOKE]         = "OP_INVOKE",
+    [OP_INHERIT]        = "OP_INHERIT",
+    [OP_GET_SUPER]      = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE]   = "OP_SUPER_INVOKE",
+    [OP_RETURN]         = "OP_RETURN",
+    [OP_TAIL_CALL]      = "OP_TAIL_CALL",
+    [OP_TAIL_INVOKE]    = "OP_TAIL_INVOKE",
+    [OP_TAIL_SUPER_INVOKE]          = "OP_TAIL_SUPER_INVOKE",
+    [OP_ADD_LOCAL_LOCAL]            = "OP_ADD_LOCAL_LOCAL",
+    [OP_LESS_LOCAL_CONSTANT_JUMP]   = "OP_LESS_LOCAL_CONSTANT_JUMP",
+    [OP_GET_PROPERTY_SET_LOCAL]     = "OP_GET_PROPERTY_SET_LOCAL",
+    [OP_ADD_NUM]        = "OP_ADD_NUM",
+    [OP_ADD_STR]        = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM]   = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM]   = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM]     = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM]    = "OP_GREATER_NUM",
+    [OP_LESS_NUM]       = "OP_LESS_NUM",
+};
+
+static const char *op_name(int op)
+{
+    return op_names[op] != NULL ? op_names[op] : "OP_UNKNOWN";
+}
+
+OpStats *new_op_stats()
+{
+    OpStats *stats = (OpStats *)calloc(1, sizeof(OpStats));
+    if (stats == NULL) exit(1);
+    stats->last = -1;
+    return stats;
+}
+
+void free_op_stats(OpStats *stats)
+{
+    free(stats);
+}
+
+void merge_op_stats(OpStats *into, OpStats *from)
+{
+    for (int i=0; i<UINT8_COUNT; i++) {
+        into->counts[i] += from->counts[i];
+        into->cycles[i] += from->cycles[i];
+        for (int j=0; j<UINT8_COUNT; j++)
+            into->pairs[i][j] += from->pairs[i][j];
+    }
+}
+
+typedef struct {
+    int first;
+    int second;
+    uint64_t count;
+}OpPair;
+
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t x = ((const OpPair *)a)->count, y = ((const OpPair *)b)->count;
+    return x < y ? 1 : x > y ? -1 : ((const OpPair *)a)->first - ((const OpPair *)b)->first;
+}
+
+// 取出现次数最多的组合, 用插入排序维护一个小的有序数组
+static int top_pairs(OpStats *stats, OpPair *top)
+{
+    int count = 0;
+    for (int i=0; i<UINT8_COUNT; i++) {
+        for (int j=0; j<UINT8_COUNT; j++) {
+            uint64_t n = stats->pairs[i][j];
+            if (n == 0 || (count == OP_STATS_TOP_PAIRS && n <= top[count-1].count))
+                continue;
+            int k = count < OP_STATS_TOP_PAIRS ? count++ : count-1;
+            while (k > 0 && top[k-1].count < n) {
+                top[k] = top[k-1];
+                k--;
+            }
+            top[k] = (OpPair){i, j, n};
+        }
+    }
+    qsort(top, count, sizeof(OpPair), compare_pairs);
+    return count;
+}
+
+void report_op_stats(FILE *fp, OpStats *stats, bool json)
+{
+    OpPair ops[UINT8_COUNT];
+    int count = 0;
+    uint64_t total = 0;
+    for (int i=0; i<UINT8_COUNT; i++) {
+        if (stats->counts[i] == 0) continue;
+        ops[count++] = (OpPair){i, -1, stats->counts[i]};
+        total += stats->counts[i];
+    }
+    qsort(ops, count, sizeof(OpPair), compare_pairs);
+    OpPair pairs[OP_STATS_TOP_PAIRS];
+    int pair_count = top_pairs(stats, pairs);
+
+    if (json) {
+        fprintf(fp, "{\"total\": %llu, \"opcodes\": [", (unsigned long long)total);
+        for (int i=0; i<count; i++) {
+            int op = ops[i].first;
+            fprintf(fp, "%s\n  {\"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}", i ? "," : "",
+                    op_name(op), (unsigned long long)stats->counts[op], (unsigned long long)stats->cycles[op]);
+        }
+        fprintf(fp, "\n], \"pairs\": [");
+        for (int i=0; i<pair_count; i++) {
+            fprintf(fp, "%s\n  {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", i ? "," : "",
+                    op_name(pairs[i].first), op_name(pairs[i].second), (unsigned long long)pairs[i].count);
+        }
+        fprintf(fp, "\n]}\n");
+        return;
+    }
+
+    fprintf(fp, "======== opcodes: %llu executed ========\n", (unsigned long long)total);
+    fprintf(fp, "%-28s %14s %7s %12s\n", "opcode", "count", "%", "cycles/op");
+    for (int i=0; i<count; i++) {
+        int op = ops[i].first;
+        fprintf(fp, "%-28s %14llu %6.2f%% %12.1f\n", op_name(op), (unsigned long long)stats->counts[op],
+                100.0 * stats->counts[op] / total, (double)stats->cycles[op] / stats->counts[op]);
+    }
+    fprintf(fp, "======== top opcode pairs ========\n");
+    for (int i=0; i<pair_count; i++) {
+        fprintf(fp, "%-28s %-28s %14llu %6.2f%%\n", op_name(pairs[i].first), op_name(pairs[i].second),
+                (unsigned long long)pairs[i].count, 100.0 * pairs[i].count / total);
+    }
+}
+
+#endif
+
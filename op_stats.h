@@ -0,0 +1,55 @@
+
+#ifndef _OP_STATS_H_
+#define _OP_STATS_H_
+
+#include "common.h"
+
+#ifdef DEBUG_OPCODE_STATS
+
+#if defined(DEBUG_OPCODE_CYCLES) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define OP_STATS_CYCLES
+#endif
+
+#define OP_STATS_TOP_PAIRS  (32)
+
+// 按opcode统计执行次数, 相邻两条指令的组合次数, 以及可选的rdtsc周期数
+typedef struct {
+    uint64_t counts[UINT8_COUNT];
+    uint64_t cycles[UINT8_COUNT];
+    uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+    int last;
+    uint64_t stamp;
+}OpStats;
+
+OpStats *new_op_stats();
+
+void free_op_stats(OpStats *stats);
+
+void merge_op_stats(OpStats *into, OpStats *from);
+
+void report_op_stats(FILE *fp, OpStats *stats, bool json);
+
+// 周期数算到上一条指令头上, 包含分派本身的开销
+static inline void count_op(OpStats *stats, uint8_t op)
+{
+    stats->counts[op]++;
+    if (stats->last >= 0) stats->pairs[stats->last][op]++;
+#ifdef OP_STATS_CYCLES
+    uint64_t now = __rdtsc();
+    if (stats->last >= 0) stats->cycles[stats->last] += now - stats->stamp;
+    stats->stamp = now;
+#endif
+    stats->last = op;
+}
+
+// 离开解释器循环(JIT, 返回)后不再把时间算给最后一条指令
+static inline void pause_op_stats(OpStats *stats)
+{
+    stats->last = -1;
+}
+
+#endif
+
+#endif
+
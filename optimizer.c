@@ -0,0 +1,44 @@
+#include "optimizer.h"
+
+// 融合只改写序列的第一个字节, 后面的字节仍是原来的指令,
+// 所以跳进序列中间的跳转不需要修正, 行号表也保持不变.
+
+static bool match(Chunk *chunk, int offset, const uint8_t *ops, const int *lengths, int count)
+{
+    for (int i=0; i<count; i++) {
+        if (offset >= chunk->count || chunk->code[offset] != ops[i]) return false;
+        offset += lengths[i];
+    }
+    return offset <= chunk->count;
+}
+
+static int fuse(Chunk *chunk, int offset)
+{
+    static const uint8_t add_local_local[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+    static const int add_local_local_len[] = {2, 2, 1};
+    static const uint8_t less_local_constant_jump[] = {OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP};
+    static const int less_local_constant_jump_len[] = {2, 2, 1, 3, 1};
+    static const uint8_t get_property_set_local[] = {OP_GET_PROPERTY, OP_SET_LOCAL};
+    static const int get_property_set_local_len[] = {4, 2};
+
+    if (match(chunk, offset, less_local_constant_jump, less_local_constant_jump_len, 5)) {
+        chunk->code[offset] = OP_LESS_LOCAL_CONSTANT_JUMP;
+        return 9;
+    }
+    if (match(chunk, offset, add_local_local, add_local_local_len, 3)) {
+        chunk->code[offset] = OP_ADD_LOCAL_LOCAL;
+        return 5;
+    }
+    if (match(chunk, offset, get_property_set_local, get_property_set_local_len, 2)) {
+        chunk->code[offset] = OP_GET_PROPERTY_SET_LOCAL;
+        return 6;
+    }
+    return instruction_length(chunk, offset);
+}
+
+void optimize_chunk(Chunk *chunk)
+{
+    for (int offset=0; offset<chunk->count;)
+        offset += fuse(chunk, offset);
+}
+
@@ -0,0 +1,9 @@
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include "chunk.h"
+
+void optimize_chunk(Chunk *chunk);
+
+#endif
+
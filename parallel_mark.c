@@ -0,0 +1,316 @@
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "parallel_mark.h"
+#include "memory.h"
+#include "vm.h"
+
+#define DEQUE_INIT      (1024)
+#define MARK_BATCH      (64)
+
+typedef struct MarkBuffer {
+    long capacity;                  // 2的幂
+    struct MarkBuffer *retired;     // 扩容前的数组, 偷的线程可能还在读, 这一轮结束后释放
+    Obj *items[];
+}MarkBuffer;
+
+// Chase-Lev deque: 所有者在bottom一端push/take, 其他线程从top一端偷
+typedef struct {
+    long top;
+    long bottom;
+    MarkBuffer *buffer;
+}MarkDeque;
+
+struct MarkWorker {
+    MarkDeque deque;
+    MarkPool *pool;
+    uint8_t epoch;
+    unsigned seed;
+} __attribute__((aligned(64)));
+
+// 主线程是0号worker, 其余线程常驻, 每次并行标记round加一唤醒它们
+struct MarkPool {
+    VM *vm;
+    int count;
+    MarkWorker *workers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int round;
+    int running;
+    bool shutdown;
+    double deadline;
+    int idle;
+    int stop;
+};
+
+__thread MarkWorker *mark_worker = NULL;
+
+static double nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static MarkBuffer *newBuffer(long capacity) {
+    MarkBuffer *buffer = (MarkBuffer *)malloc(sizeof(MarkBuffer) + sizeof(Obj *)*capacity);
+    if (buffer == NULL) exit(1);
+    buffer->capacity = capacity;
+    buffer->retired = NULL;
+    return buffer;
+}
+
+static void freeRetired(MarkBuffer *buffer) {
+    MarkBuffer *retired = buffer->retired;
+    buffer->retired = NULL;
+    while (retired != NULL) {
+        MarkBuffer *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+}
+
+static long dequeSize(MarkDeque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    return bottom - top;
+}
+
+static void dequePush(MarkDeque *deque, Obj *object) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    MarkBuffer *buffer = deque->buffer;
+    if (bottom - top >= buffer->capacity) {
+        MarkBuffer *bigger = newBuffer(buffer->capacity * 2);
+        for (long i = top; i < bottom; i++) {
+            bigger->items[i & (bigger->capacity - 1)] =
+                __atomic_load_n(&buffer->items[i & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+        }
+        bigger->retired = buffer;
+        __atomic_store_n(&deque->buffer, bigger, __ATOMIC_RELEASE);
+        buffer = bigger;
+    }
+    __atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], object, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+static Obj *dequeTake(MarkDeque *deque) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    MarkBuffer *buffer = deque->buffer;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Obj *object = __atomic_load_n(&buffer->items[bottom & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // 只剩最后一个, 和偷的线程抢
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            object = NULL;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+// 返回NULL表示deque是空的或者被别的线程抢先了
+static Obj *dequeSteal(MarkDeque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+    MarkBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    Obj *object = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return object;
+}
+
+void worker_mark(MarkWorker *worker, Obj *object) {
+    if (__atomic_load_n(&object->mark, __ATOMIC_RELAXED) == worker->epoch) return;
+    // 几个线程可能同时看到未标记, 只有把标记换上去的那个负责扫描
+    if (__atomic_exchange_n(&object->mark, worker->epoch, __ATOMIC_RELAXED) == worker->epoch) return;
+    dequePush(&worker->deque, object);
+}
+
+static bool stealWork(MarkWorker *worker) {
+    MarkPool *pool = worker->pool;
+    int start = rand_r(&worker->seed) % pool->count;
+    for (int i = 0; i < pool->count; i++) {
+        MarkWorker *victim = &pool->workers[(start + i) % pool->count];
+        if (victim == worker) continue;
+        Obj *object = dequeSteal(&victim->deque);
+        if (object != NULL) {
+            dequePush(&worker->deque, object);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 只有自己的deque空了才算空闲, 空闲的线程不会产生新对象,
+// 所以全部空闲就是标记完成; 还有非空的deque就回去偷
+static bool waitForWork(MarkWorker *worker) {
+    MarkPool *pool = worker->pool;
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->count)
+            return true;
+        for (int i = 0; i < pool->count; i++) {
+            if (dequeSize(&pool->workers[i].deque) > 0) {
+                __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                return false;
+            }
+        }
+        sched_yield();
+    }
+}
+
+// 处理自己的deque, 到deadline返回false
+static bool drainDeque(MarkWorker *worker) {
+    MarkPool *pool = worker->pool;
+    int batch = 0;
+    Obj *object;
+    while ((object = dequeTake(&worker->deque)) != NULL) {
+        blackenObject(pool->vm, object);
+        if (++batch < MARK_BATCH) continue;
+        batch = 0;
+        if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) return false;
+        if (nowUs() >= pool->deadline) {
+            __atomic_store_n(&pool->stop, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void runWorker(MarkWorker *worker) {
+    mark_worker = worker;
+    while (drainDeque(worker)) {
+        if (!stealWork(worker) && waitForWork(worker)) break;
+    }
+    mark_worker = NULL;
+}
+
+static void *markThread(void *arg) {
+    MarkWorker *worker = (MarkWorker *)arg;
+    MarkPool *pool = worker->pool;
+    int round = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->round == round && !pool->shutdown)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown) break;
+        round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+
+        runWorker(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static MarkPool *newPool(VM *vm, int count) {
+    MarkPool *pool = (MarkPool *)malloc(sizeof(MarkPool));
+    MarkWorker *workers = (MarkWorker *)aligned_alloc(64, sizeof(MarkWorker)*count);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t)*count);
+    if (pool == NULL || workers == NULL || threads == NULL) exit(1);
+    pool->vm = vm;
+    pool->workers = workers;
+    pool->threads = threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->round = 0;
+    pool->running = 0;
+    pool->shutdown = false;
+    for (int i = 0; i < count; i++) {
+        workers[i].deque.top = 0;
+        workers[i].deque.bottom = 0;
+        workers[i].deque.buffer = newBuffer(DEQUE_INIT);
+        workers[i].pool = pool;
+        workers[i].epoch = 0;
+        workers[i].seed = i + 1;
+    }
+    // 线程创建失败就少用几个
+    pool->count = 1;
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, markThread, &workers[i]) != 0)
+            break;
+        pool->count++;
+    }
+    for (int i = pool->count; i < count; i++)
+        free(workers[i].deque.buffer);
+    return pool;
+}
+
+void parallel_trace(VM *vm, double deadline) {
+    if (vm->markPool == NULL)
+        vm->markPool = newPool(vm, vm->gcThreads);
+    MarkPool *pool = vm->markPool;
+
+    for (int i = 0; i < pool->count; i++)
+        pool->workers[i].epoch = vm->markEpoch;
+    for (int i = 0; i < vm->grayCount; i++)
+        dequePush(&pool->workers[i % pool->count].deque, vm->grayStack[i]);
+    vm->grayCount = 0;
+    pool->deadline = deadline;
+    pool->idle = 0;
+    pool->stop = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = pool->count - 1;
+    pool->round++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    runWorker(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    // 到deadline停下时没处理完的对象放回gray stack, 下一步再分
+    for (int i = 0; i < pool->count; i++) {
+        MarkDeque *deque = &pool->workers[i].deque;
+        MarkBuffer *buffer = deque->buffer;
+        for (long j = deque->top; j < deque->bottom; j++)
+            pushGray(vm, buffer->items[j & (buffer->capacity - 1)]);
+        deque->top = 0;
+        deque->bottom = 0;
+        freeRetired(buffer);
+    }
+}
+
+void free_mark_pool(MarkPool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->count; i++) {
+        freeRetired(pool->workers[i].deque.buffer);
+        free(pool->workers[i].deque.buffer);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,22 @@
+
+#ifndef _PARALLEL_MARK_H_
+#define _PARALLEL_MARK_H_
+
+#include "common.h"
+#include "object.h"
+
+typedef struct MarkWorker MarkWorker;
+typedef struct MarkPool MarkPool;
+
+// 并行标记时每个线程当前的worker, markObject据此把对象放进自己的deque
+extern __thread MarkWorker *mark_worker;
+
+void worker_mark(MarkWorker *worker, Obj *object);
+
+// 用vm->gcThreads个线程处理gray stack, 到deadline时停下, 剩下的对象放回gray stack
+void parallel_trace(VM *vm, double deadline);
+
+void free_mark_pool(MarkPool *pool);
+
+#endif
+
@@ -0,0 +1,182 @@
+
+#include <sys/time.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+// SIGPROF是进程级的, 同一时间只能有一个VM在采样
+static Profiler *active = NULL;
+
+static void on_sigprof(int sig)
+{
+    Profiler *profiler = active;
+    if (profiler == NULL) return;
+    if (profiler->busy) {
+        profiler->dropped++;
+        return;
+    }
+    VM *vm = profiler->vm;
+    int count = vm->frameCount;
+    int depth = count < PROFILE_MAX_DEPTH ? count : PROFILE_MAX_DEPTH;
+    if (depth == 0) return;
+    if (profiler->used + 1 + depth*2 > PROFILE_BUFFER) {
+        profiler->dropped++;
+        return;
+    }
+
+    uintptr_t *out = profiler->buffer + profiler->used;
+    *out++ = (uintptr_t)depth;
+    for (int i=count-1; i>=count-depth; i--) {
+        CallFrame *frame = &vm->frames[i];
+        ObjFunction *function = frame->closure->function;
+        *out++ = (uintptr_t)function;
+        *out++ = (uintptr_t)(frame->ip - function->chunk.code);
+    }
+    profiler->used = (int)(out - profiler->buffer);
+    profiler->samples++;
+}
+
+static uint64_t hash_stack(const char *stack)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *stack; stack++) {
+        hash ^= (uint8_t)*stack;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static ProfileEntry *find_entry(ProfileEntry *entries, int capacity, const char *stack)
+{
+    uint64_t index = hash_stack(stack) & (capacity - 1);
+    while (entries[index].stack != NULL && strcmp(entries[index].stack, stack) != 0)
+        index = (index + 1) & (capacity - 1);
+    return &entries[index];
+}
+
+static void add_stack(Profiler *profiler, const char *stack, int length)
+{
+    if (profiler->entryCount + 1 > profiler->entryCapacity * 3 / 4) {
+        int capacity = profiler->entryCapacity < 64 ? 64 : profiler->entryCapacity * 2;
+        ProfileEntry *entries = (ProfileEntry *)calloc(capacity, sizeof(ProfileEntry));
+        if (entries == NULL) exit(1);
+        for (int i=0; i<profiler->entryCapacity; i++) {
+            if (profiler->entries[i].stack == NULL) continue;
+            *find_entry(entries, capacity, profiler->entries[i].stack) = profiler->entries[i];
+        }
+        free(profiler->entries);
+        profiler->entries = entries;
+        profiler->entryCapacity = capacity;
+    }
+    ProfileEntry *entry = find_entry(profiler->entries, profiler->entryCapacity, stack);
+    if (entry->stack == NULL) {
+        entry->stack = (char *)malloc(length + 1);
+        if (entry->stack == NULL) exit(1);
+        memcpy(entry->stack, stack, length + 1);
+        profiler->entryCount++;
+    }
+    entry->count++;
+}
+
+static int append_frame(char *out, int length, int size, ObjFunction *function, size_t offset, bool lines)
+{
+    const char *name = function->name != NULL ? function->name->chars : "script";
+    int written;
+    // ip指向下一条指令, 当前指令在它前面
+    if (lines && offset > 0 && offset <= (size_t)function->chunk.count) {
+        written = snprintf(out + length, size - length, "%s%s:%d", length ? ";" : "",
+                           name, get_line(&function->chunk, (int)offset - 1));
+    } else {
+        written = snprintf(out + length, size - length, "%s%s", length ? ";" : "", name);
+    }
+    return written < size - length ? length + written : size - 1;
+}
+
+// 在函数对象还活着的时候(GC前)把原始样本转换成折叠栈
+void flush_profiler(Profiler *profiler)
+{
+    profiler->busy++;
+    char stack[8192];
+    for (int at=0; at<profiler->used;) {
+        int depth = (int)profiler->buffer[at++];
+        uintptr_t *frames = profiler->buffer + at;
+        at += depth * 2;
+
+        int length = 0;
+        if (depth == PROFILE_MAX_DEPTH)
+            length = snprintf(stack, sizeof(stack), "[truncated]");
+        for (int i=depth-1; i>=0; i--) {
+            length = append_frame(stack, length, sizeof(stack), (ObjFunction *)frames[i*2],
+                                  (size_t)frames[i*2+1], profiler->lines);
+        }
+        add_stack(profiler, stack, length);
+    }
+    profiler->used = 0;
+    profiler->busy--;
+}
+
+bool start_profiler(VM *vm, const char *path, bool lines)
+{
+    if (active != NULL) return false;
+    Profiler *profiler = (Profiler *)calloc(1, sizeof(Profiler));
+    if (profiler == NULL) return false;
+    profiler->buffer = (uintptr_t *)malloc(sizeof(uintptr_t) * PROFILE_BUFFER);
+    if (profiler->buffer == NULL) {
+        free(profiler);
+        return false;
+    }
+    profiler->vm = vm;
+    profiler->path = path;
+    profiler->lines = lines;
+    vm->profiler = profiler;
+    active = profiler;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return true;
+}
+
+void stop_profiler(VM *vm)
+{
+    Profiler *profiler = vm->profiler;
+    if (profiler == NULL) return;
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    active = NULL;
+
+    flush_profiler(profiler);
+    FILE *fp = fopen(profiler->path, "w");
+    if (fp == NULL) {
+        fprintf(vm->err, "Could not write profile %s\n", profiler->path);
+    } else {
+        for (int i=0; i<profiler->entryCapacity; i++) {
+            ProfileEntry *entry = &profiler->entries[i];
+            if (entry->stack != NULL)
+                fprintf(fp, "%s %llu\n", entry->stack, (unsigned long long)entry->count);
+        }
+        fclose(fp);
+    }
+    fprintf(vm->err, "======== profile: %llu samples, %llu dropped, %d stacks -> %s ========\n",
+            (unsigned long long)profiler->samples, (unsigned long long)profiler->dropped,
+            profiler->entryCount, profiler->path);
+
+    for (int i=0; i<profiler->entryCapacity; i++)
+        free(profiler->entries[i].stack);
+    free(profiler->entries);
+    free(profiler->buffer);
+    free(profiler);
+    vm->profiler = NULL;
+}
+
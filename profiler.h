@@ -0,0 +1,45 @@
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <signal.h>
+
+#include "common.h"
+
+#define PROFILE_HZ          (1000)
+#define PROFILE_BUFFER      (1 << 20)
+#define PROFILE_MAX_DEPTH   (128)
+
+typedef struct {
+    char *stack;
+    uint64_t count;
+}ProfileEntry;
+
+// 信号处理函数只把(function, ip偏移)写进预先分配的缓冲区,
+// GC之前和结束时再转换成折叠的调用栈字符串
+typedef struct Profiler {
+    VM *vm;
+    const char *path;
+    bool lines;
+    uintptr_t *buffer;
+    volatile int used;
+    volatile sig_atomic_t busy;
+    volatile uint64_t samples;
+    volatile uint64_t dropped;
+    ProfileEntry *entries;
+    int entryCount;
+    int entryCapacity;
+}Profiler;
+
+// 修改调用栈数组时暂停采样
+#define PROFILE_PAUSE(vm)   do { if ((vm)->profiler != NULL) (vm)->profiler->busy++; } while (0)
+#define PROFILE_RESUME(vm)  do { if ((vm)->profiler != NULL) (vm)->profiler->busy--; } while (0)
+
+bool start_profiler(VM *vm, const char *path, bool lines);
+
+void flush_profiler(Profiler *profiler);
+
+void stop_profiler(VM *vm);
+
+#endif
+
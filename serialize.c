@@ -0,0 +1,484 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "serialize.h"
+#include "memory.h"
+#include "vm.h"
+
+// 文件布局(小端):
+//   "LOXC" u32版本 u32全局变量数 {字符串}... 函数
+//   函数 = u32 arity, u32 upvalueCount, 名字, u32常量数 {常量}...,
+//          u32字节码长度 字节码, u32行号段数 对齐到4 {u32 offset, u32 line}..., u32 inline cache数
+//   常量 = 'N' f64 | 'S' 字符串 | 'F' 函数 | 'n' | 't' | 'f'
+//   字符串 = u32长度 字节 '\0'; 名字 = u8(0无名/1有名) [字符串]
+// 字节码里的全局变量槽位只在写出它的VM里有效, 加载时按名字重新分配.
+// 映射加载时字节码, 行号表和字符串直接指向只读的文件内容, 槽位不用重新分配时不需要任何复制.
+// 映射的字符串常量在函数第一次创建闭包时才驻留; 全局变量名和函数名加载时就驻留.
+
+enum {
+    CONST_NUMBER = 'N',
+    CONST_STRING = 'S',
+    CONST_FUNCTION = 'F',
+    CONST_NIL = 'n',
+    CONST_TRUE = 't',
+    CONST_FALSE = 'f',
+};
+
+static void write_u32(FILE *fp, uint32_t value)
+{
+    uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    fwrite(bytes, 1, 4, fp);
+}
+
+static void write_chars(FILE *fp, const char *chars, uint32_t length)
+{
+    write_u32(fp, length);
+    fwrite(chars, 1, length + 1, fp);
+}
+
+static void write_string(FILE *fp, ObjString *string)
+{
+    write_chars(fp, string->chars, string->length);
+}
+
+static void write_function(FILE *fp, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    write_u32(fp, function->arity);
+    write_u32(fp, function->upvalueCount);
+    fputc(function->name != NULL, fp);
+    if (function->name != NULL) write_string(fp, function->name);
+
+    write_u32(fp, chunk->constants.count);
+    for (int i=0; i<chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        const char *lazy = function->lazyStrings != NULL ? function->lazyStrings[i] : NULL;
+        if (lazy != NULL) {
+            fputc(CONST_STRING, fp);
+            write_chars(fp, lazy, strlen(lazy));
+        } else if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            fputc(CONST_NUMBER, fp);
+            write_u32(fp, (uint32_t)bits);
+            write_u32(fp, (uint32_t)(bits >> 32));
+        } else if (IS_STRING(value)) {
+            fputc(CONST_STRING, fp);
+            write_string(fp, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            fputc(CONST_FUNCTION, fp);
+            write_function(fp, AS_FUNCTION(value));
+        } else if (IS_BOOL(value)) {
+            fputc(AS_BOOL(value) ? CONST_TRUE : CONST_FALSE, fp);
+        } else {
+            fputc(CONST_NIL, fp);
+        }
+    }
+
+    write_u32(fp, chunk->count);
+    fwrite(chunk->code, 1, chunk->count, fp);
+    write_u32(fp, chunk->line_count);
+    while (ftell(fp) % 4 != 0)
+        fputc(0, fp);
+    for (int i=0; i<chunk->line_count; i++) {
+        write_u32(fp, chunk->lines[i].offset);
+        write_u32(fp, chunk->lines[i].line);
+    }
+    write_u32(fp, chunk->cache_count);
+}
+
+bool is_bytecode(const char *data, size_t size)
+{
+    return size >= 4 && memcmp(data, LOXC_MAGIC, 4) == 0;
+}
+
+bool save_bytecode(VM *vm, ObjFunction *function, FILE *fp)
+{
+    fwrite(LOXC_MAGIC, 1, 4, fp);
+    write_u32(fp, LOXC_VERSION);
+    write_u32(fp, vm->globalNames.count);
+    for (int i=0; i<vm->globalNames.count; i++)
+        write_string(fp, AS_STRING(vm->globalNames.values[i]));
+    write_function(fp, function);
+    return !ferror(fp);
+}
+
+typedef struct {
+    VM *vm;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    bool error;
+    int *slots;
+    int slot_count;
+    bool in_place;
+}Reader;
+
+static const uint8_t *read_bytes(Reader *reader, size_t length)
+{
+    if (reader->error || reader->size - reader->pos < length) {
+        reader->error = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->data + reader->pos;
+    reader->pos += length;
+    return bytes;
+}
+
+static uint8_t read_u8(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static uint32_t read_u32(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, 4);
+    if (bytes == NULL) return 0;
+    return bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static const char *read_chars(Reader *reader, int *length)
+{
+    uint32_t size = read_u32(reader);
+    if (size >= INT32_MAX) {
+        reader->error = true;
+        return NULL;
+    }
+    const uint8_t *chars = read_bytes(reader, size + 1);
+    if (chars == NULL || chars[size] != '\0') {
+        reader->error = true;
+        return NULL;
+    }
+    *length = (int)size;
+    return (const char *)chars;
+}
+
+static ObjString *read_string(Reader *reader)
+{
+    int length;
+    const char *chars = read_chars(reader, &length);
+    if (chars == NULL)
+        return NULL;
+    if (reader->in_place)
+        return map_string(reader->vm, chars, length);
+    return copy_string(reader->vm, chars, length);
+}
+
+static void skip_padding(Reader *reader, size_t align)
+{
+    size_t padding = (align - reader->pos % align) % align;
+    read_bytes(reader, padding);
+}
+
+static bool little_endian()
+{
+    uint16_t probe = 1;
+    return *(uint8_t *)&probe == 1;
+}
+
+static bool valid_constant(ObjFunction *function, int index, bool string)
+{
+    Chunk *chunk = &function->chunk;
+    return index < chunk->constants.count &&
+           (!string || IS_STRING(chunk->constants.values[index]) ||
+            (function->lazyStrings != NULL && function->lazyStrings[index] != NULL));
+}
+
+static bool valid_cache(Chunk *chunk, const uint8_t *operand)
+{
+    return ((operand[0] << 8) | operand[1]) < chunk->cache_count;
+}
+
+// 检查字节码的每个操作数都在范围内, 同时把全局变量槽位换成当前VM的槽位(映射的字节码只检查不修改).
+// 融合指令后面的字节仍是原来的指令(见optimizer.c), 所以只检查第一条原指令, 然后按原指令继续走
+static int check_instruction(Reader *reader, ObjFunction *function, int offset)
+{
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code + offset;
+    int rest = chunk->count - offset;
+    switch (code[0]) {
+        case OP_NIL: case OP_FALSE: case OP_TRUE: case OP_NOT: case OP_NEGATE:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_ADD: case OP_SUBTRACT:
+        case OP_MULTIPLY: case OP_DIVIDE: case OP_PRINT: case OP_POP: case OP_CLOSE_UPVALUE:
+        case OP_INHERIT: case OP_RETURN:
+            return 1;
+        case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_CALL: case OP_TAIL_CALL:
+            return rest >= 2 ? 2 : 0;
+        case OP_CONSTANT:
+            return rest >= 2 && valid_constant(function, code[1], false) ? 2 : 0;
+        case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+            return rest >= 2 && code[1] < function->upvalueCount ? 2 : 0;
+        case OP_CLASS: case OP_METHOD: case OP_GET_SUPER:
+            return rest >= 2 && valid_constant(function, code[1], true) ? 2 : 0;
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP:
+            // 跳转目标等所有指令的位置都知道了再检查
+            return rest >= 3 ? 3 : 0;
+        case OP_SUPER_INVOKE: case OP_TAIL_SUPER_INVOKE:
+            return rest >= 3 && valid_constant(function, code[1], true) ? 3 : 0;
+        case OP_GET_PROPERTY: case OP_SET_PROPERTY:
+            return rest >= 4 && valid_constant(function, code[1], true) && valid_cache(chunk, code + 2) ? 4 : 0;
+        case OP_INVOKE: case OP_TAIL_INVOKE:
+            return rest >= 5 && valid_constant(function, code[1], true) && valid_cache(chunk, code + 3) ? 5 : 0;
+        case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL: {
+            if (rest < 3) return 0;
+            int slot = (code[1] << 8) | code[2];
+            if (slot >= reader->slot_count) return 0;
+            if (!chunk->mapped) {
+                slot = reader->slots[slot];
+                code[1] = (uint8_t)(slot >> 8);
+                code[2] = (uint8_t)slot;
+            }
+            return 3;
+        }
+        case OP_CLOSURE: {
+            if (rest < 2 || !valid_constant(function, code[1], false) ||
+                !IS_FUNCTION(chunk->constants.values[code[1]]))
+                return 0;
+            int length = 2 + AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount * 2;
+            if (rest < length) return 0;
+            for (int i=2; i<length; i+=2) {
+                if (!code[i] && code[i+1] >= function->upvalueCount) return 0;
+            }
+            return length;
+        }
+        case OP_ADD_LOCAL_LOCAL:
+            return rest >= 5 && code[2] == OP_GET_LOCAL && code[4] == OP_ADD ? 2 : 0;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return rest >= 9 && code[2] == OP_CONSTANT && code[4] == OP_LESS &&
+                   code[5] == OP_JUMP_IF_FALSE && code[8] == OP_POP ? 2 : 0;
+        case OP_GET_PROPERTY_SET_LOCAL:
+            return rest >= 6 && valid_constant(function, code[1], true) && valid_cache(chunk, code + 2) &&
+                   code[4] == OP_SET_LOCAL ? 4 : 0;
+        default:
+            // 文件在运行前写出, 不会有quickening的opcode; 映射的字节码也改不回通用的opcode
+            return 0;
+    }
+}
+
+// 跳转只能落在指令开头; 最后一条必须是OP_RETURN, 否则会执行到字节码外面
+static bool check_code(Reader *reader, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    bool *starts = (bool *)calloc(chunk->count, sizeof(bool));
+    if (starts == NULL) exit(1);
+    bool valid = true;
+    int last = 0;
+    for (int offset=0; valid && offset<chunk->count;) {
+        int length = check_instruction(reader, function, offset);
+        starts[offset] = true;
+        last = offset;
+        valid = length > 0;
+        offset += length;
+    }
+    valid = valid && chunk->code[last] == OP_RETURN;
+    for (int offset=0; valid && offset<chunk->count; offset++) {
+        uint8_t op = chunk->code[offset];
+        if (!starts[offset] || (op != OP_JUMP && op != OP_JUMP_IF_FALSE && op != OP_LOOP))
+            continue;
+        int jump = (chunk->code[offset+1] << 8) | chunk->code[offset+2];
+        int target = op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+        valid = target >= 0 && target < chunk->count && starts[target];
+    }
+    free(starts);
+    return valid;
+}
+
+static ObjFunction *read_function(Reader *reader, int depth)
+{
+    VM *vm = reader->vm;
+    ObjFunction *function = new_function(vm);
+    push(vm, OBJ_VAL(function));
+    Chunk *chunk = &function->chunk;
+    uint32_t arity = read_u32(reader);
+    uint32_t upvalues = read_u32(reader);
+    if (arity > UINT8_MAX || upvalues > UINT8_COUNT) reader->error = true;
+    function->arity = reader->error ? 0 : (int)arity;
+    function->upvalueCount = reader->error ? 0 : (int)upvalues;
+    if (read_u8(reader)) {
+        function->name = read_string(reader);
+        WRITE_BARRIER_OBJ(vm, function, function->name);
+    }
+
+    uint32_t constants = read_u32(reader);
+    if (constants > reader->size) reader->error = true;
+    for (uint32_t i=0; i<constants && !reader->error; i++) {
+        Value value = NIL_VAL;
+        switch (read_u8(reader)) {
+            case CONST_NUMBER: {
+                uint64_t bits = read_u32(reader);
+                bits |= (uint64_t)read_u32(reader) << 32;
+                double number;
+                memcpy(&number, &bits, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case CONST_STRING: {
+                if (reader->in_place) {
+                    int length;
+                    const char *chars = read_chars(reader, &length);
+                    if (chars == NULL) break;
+                    if (function->lazyStrings == NULL) {
+                        function->lazyStrings = ALLOCATE_ARRAY(vm, const char *, constants);
+                        memset(function->lazyStrings, 0, sizeof(const char *) * constants);
+                    }
+                    function->lazyStrings[i] = chars;
+                    break;
+                }
+                ObjString *string = read_string(reader);
+                if (string != NULL) value = OBJ_VAL(string);
+                break;
+            }
+            case CONST_FUNCTION: {
+                // 先检查深度再递归: 每次read_function都要在栈上留下一个函数给这里弹出
+                if (depth >= UINT8_COUNT) {
+                    reader->error = true;
+                    break;
+                }
+                ObjFunction *nested = read_function(reader, depth + 1);
+                if (nested != NULL) value = OBJ_VAL(nested);
+                pop(vm);
+                break;
+            }
+            case CONST_NIL:     value = NIL_VAL; break;
+            case CONST_TRUE:    value = BOOL_VAL(true); break;
+            case CONST_FALSE:   value = BOOL_VAL(false); break;
+            default:
+                reader->error = true;
+                break;
+        }
+        add_constant(vm, chunk, value);
+        WRITE_BARRIER(vm, function, value);
+    }
+    // free_function按常量数释放lazyStrings
+    if (function->lazyStrings != NULL && chunk->constants.count != (int)constants) {
+        FREE_ARRAY(vm, const char *, function->lazyStrings, constants);
+        function->lazyStrings = NULL;
+    }
+
+    uint32_t count = read_u32(reader);
+    const uint8_t *code = read_bytes(reader, count);
+    uint32_t lines = read_u32(reader);
+    skip_padding(reader, 4);
+    if (lines > count) reader->error = true;
+    const uint8_t *line_data = read_bytes(reader, (size_t)lines * 8);
+    if (reader->error || count == 0 || lines == 0) {
+        reader->error = true;
+        return NULL;
+    }
+    if (reader->in_place && ((uintptr_t)line_data & (sizeof(int) - 1)) == 0) {
+        chunk->code = (uint8_t *)code;
+        chunk->lines = (LineStart *)line_data;
+        chunk->mapped = true;
+    }
+    else {
+        chunk->code = ALLOCATE_ARRAY(vm, uint8_t, count);
+        memcpy(chunk->code, code, count);
+        chunk->lines = ALLOCATE_ARRAY(vm, LineStart, lines);
+        for (uint32_t i=0; i<lines; i++) {
+            const uint8_t *entry = line_data + i * 8;
+            chunk->lines[i].offset = entry[0] | entry[1] << 8 | entry[2] << 16 | (uint32_t)entry[3] << 24;
+            chunk->lines[i].line = entry[4] | entry[5] << 8 | entry[6] << 16 | (uint32_t)entry[7] << 24;
+        }
+    }
+    chunk->capacity = chunk->count = count;
+    chunk->line_capacity = chunk->line_count = lines;
+    uint32_t caches = read_u32(reader);
+    for (uint32_t i=0; i<caches && !reader->error; i++)
+        add_inline_cache(vm, chunk);
+
+    if (!reader->error && !check_code(reader, function))
+        reader->error = true;
+    // 函数留在栈上, 由调用者弹出
+    return reader->error ? NULL : function;
+}
+
+ObjFunction *load_bytecode(VM *vm, const char *data, size_t size, bool in_place)
+{
+    Reader reader = {vm, (const uint8_t *)data, size, 0, false, NULL, 0, false};
+    Value *top = vm->top;
+    const uint8_t *magic = read_bytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, LOXC_MAGIC, 4) != 0) return NULL;
+    if (read_u32(&reader) != LOXC_VERSION) return NULL;
+
+    uint32_t globals = read_u32(&reader);
+    if (globals > size) return NULL;
+    reader.slots = (int *)malloc(sizeof(int) * (globals + 1));
+    if (reader.slots == NULL) exit(1);
+    for (uint32_t i=0; i<globals && !reader.error; i++) {
+        ObjString *name = read_string(&reader);
+        if (name == NULL) break;
+        reader.slots[i] = global_slot(vm, name);
+        reader.slot_count++;
+    }
+    // 只有槽位和写出时一致(同样在新VM里运行的第一个脚本)才能原样使用字节码
+    reader.in_place = in_place && little_endian();
+    for (int i=0; i<reader.slot_count; i++) {
+        if (reader.slots[i] != i)
+            reader.in_place = false;
+    }
+
+    ObjFunction *function = reader.error ? NULL : read_function(&reader, 0);
+    free(reader.slots);
+    vm->top = top;
+    // 脚本按没有参数的闭包调用
+    if (reader.error || reader.pos != size || function->arity != 0 || function->upvalueCount != 0)
+        return NULL;
+    return function;
+}
+
+typedef struct Image {
+    struct Image *next;
+    char *data;
+    size_t size;
+}Image;
+
+// 只读映射: 同一镜像的进程共享页面. 映射的字节码不做quickening, 全局变量槽位不一致时复制一份再改
+Image *open_image(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= 4)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    if (!is_bytecode((const char *)data, st.st_size)) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    Image *image = (Image *)malloc(sizeof(Image));
+    if (image == NULL) exit(1);
+    image->next = NULL;
+    image->data = (char *)data;
+    image->size = st.st_size;
+    return image;
+}
+
+// 镜像归VM所有, 在free_vm里解除映射. 加载失败时已经驻留的字符串可能还指向镜像, 同样要等到free_vm
+ObjFunction *load_image(VM *vm, Image *image)
+{
+    image->next = vm->images;
+    vm->images = image;
+    return load_bytecode(vm, image->data, image->size, true);
+}
+
+void close_images(VM *vm)
+{
+    Image *image = vm->images;
+    while (image != NULL) {
+        Image *next = image->next;
+        munmap(image->data, image->size);
+        free(image);
+        image = next;
+    }
+    vm->images = NULL;
+}
+
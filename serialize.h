@@ -0,0 +1,29 @@
+
+#ifndef _SERIALIZE_H_
+#define _SERIALIZE_H_
+
+#include "common.h"
+#include "obj_function.h"
+
+// 字节码格式变化(包括opcode编号)时要增加版本号
+#define LOXC_MAGIC          "LOXC"
+#define LOXC_VERSION        (3)
+
+bool is_bytecode(const char *data, size_t size);
+
+bool save_bytecode(VM *vm, ObjFunction *function, FILE *fp);
+
+// in_place: data在VM的整个生命周期内有效, 字节码和字符串可以直接指向它
+ObjFunction *load_bytecode(VM *vm, const char *data, size_t size, bool in_place);
+
+typedef struct Image Image;
+
+// 把.loxc文件映射进内存, 不是字节码文件时返回NULL
+Image *open_image(const char *path);
+
+ObjFunction *load_image(VM *vm, Image *image);
+
+void close_images(VM *vm);
+
+#endif
+
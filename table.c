@@ -1,6 +1,7 @@
 
 #include "table.h"
 #include "memory.h"
+#include "vm.h"
 
 void init_table(Table *table)
 {
@@ -9,9 +10,9 @@ void init_table(Table *table)
     table->entries = NULL;
 }
 
-void free_table(Table *table)
+void free_table(VM *vm, Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     init_table(table);
 }
 
@@ -37,9 +38,9 @@ static Entry *find_entry(Entry *entries, int capacity, ObjString *key)
     return NULL;
 }
 
-static void adjust_capacity(Table *table, int capacity)
+static void adjust_capacity(VM *vm, Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE_ARRAY(Entry, capacity);
+    Entry *entries = ALLOCATE_ARRAY(vm, Entry, capacity);
     for (int i=0; i<capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -53,16 +54,16 @@ static void adjust_capacity(Table *table, int capacity)
         dst->value = entry->value;
         table->count++;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
 }
 
-bool table_set(Table *table, ObjString *key, Value value)
+bool table_set(VM *vm, Table *table, ObjString *key, Value value)
 {
     if (table->count+1 > table->capacity*TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+        adjust_capacity(vm, table, capacity);
     }
     Entry *entry = find_entry(table->entries, table->capacity, key);
     bool is_new_key = entry->key == NULL;
@@ -91,11 +92,11 @@ bool table_del(Table *table, ObjString *key)
     return true;
 }
 
-void table_copy(Table *from, Table *to)
+void table_copy(VM *vm, Table *from, Table *to)
 {
     for (int i=0; i<from->capacity; i++) {
         Entry *entry = &from->entries[i];
-        if (entry != NULL) table_set(to, entry->key, entry->value);
+        if (entry->key != NULL) table_set(vm, to, entry->key, entry->value);
     }
 }
 
@@ -117,18 +118,18 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
     return NULL;
 }
 
-void markTable(Table* table) {
+void markTable(VM *vm, Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+    markObject(vm, (Obj*)entry->key);
+    markValue(vm, entry->value);
   }
 }
 
-void tableRemoveWhite(Table* table) {
+void tableRemoveWhite(VM *vm, Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
+    if (entry->key != NULL && !IS_MARKED(vm, &entry->key->obj)) {
       table_del(table, entry->key);
     }
   }
@@ -20,21 +20,21 @@ typedef struct {
 
 void init_table(Table *table);
 
-void free_table(Table *table);
+void free_table(VM *vm, Table *table);
 
-bool table_set(Table *table, ObjString *key, Value value);
+bool table_set(VM *vm, Table *table, ObjString *key, Value value);
 
 bool table_get(Table *table, ObjString *key, Value *value);
 
 bool table_del(Table *table, ObjString *key);
 
-void table_copy(Table *from, Table *to);
+void table_copy(VM *vm, Table *from, Table *to);
 
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
 
-void markTable(Table* table);
+void markTable(VM *vm, Table* table);
 
-void tableRemoveWhite(Table* table);
+void tableRemoveWhite(VM *vm, Table* table);
 
 #endif
 
@@ -0,0 +1,493 @@
+#!/usr/bin/env python3
+"""Lox test runner.
+
+Runs every tests/*/*.lox script and compares what it prints with the files
+next to it: NAME.out holds the expected stdout, NAME.err the expected stderr
+(no .err file means nothing on stderr). Every script runs in each mode and
+all modes must produce the same output:
+
+    interp  compile the source, no code cache
+    loxc    --compile to a .loxc file, then run the .loxc
+    cache   run twice with an empty $LOX_CACHE_DIR, the second run loads
+            what the first one wrote
+    jit     like interp with --jit; also diffed against the interp output
+    jit-loxc
+            like loxc with --jit, machine code for code that never quickens
+
+Afterwards the loader is fed truncated, corrupted and version-mismatched
+.loxc files. It must reject every one of them without crashing. The code
+cache must survive corrupted entries, edited sources, concurrent writers and
+a directory it cannot write to.
+
+    # build the source tree and run everything
+    python3 tests/run.py
+
+    # test an existing binary, only the bytecode scripts, under ASan
+    python3 tests/run.py --lox ./lox --filter bytecode
+    python3 tests/run.py --cflags "-fsanitize=address -g"
+"""
+
+import argparse
+import difflib
+import glob
+import os
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(TESTS_DIR)
+
+MODES = ["interp", "loxc", "cache", "jit", "jit-loxc"]
+REJECTED = "Invalid or incompatible bytecode file"
+
+
+def build(cflags, out_dir):
+    path = os.path.join(out_dir, "lox")
+    sources = sorted(glob.glob(os.path.join(ROOT_DIR, "*.c")))
+    cmd = ["gcc", "-O2", "-DNDEBUG"] + cflags.split() + ["-o", path] + sources + ["-lpthread"]
+    print("building: %s" % " ".join(["gcc", "-O2", "-DNDEBUG"] + cflags.split()), file=sys.stderr)
+    subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+    return path
+
+
+def run_lox(binary, args, env=None, timeout=60):
+    env = dict(os.environ, ASAN_OPTIONS="detect_leaks=0", **(env or {}))
+    try:
+        proc = subprocess.run([binary] + args, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                              text=True, errors="replace", env=env, timeout=timeout)
+    except subprocess.TimeoutExpired:
+        return -1, "", "timed out after %ds\n" % timeout
+    stdout = "".join(l for l in proc.stdout.splitlines(True) if not l.startswith("======== run:"))
+    return proc.returncode, stdout, proc.stderr
+
+
+def crashed(status, stderr):
+    return status < 0 or "AddressSanitizer" in stderr or "runtime error:" in stderr
+
+
+def run_mode(binary, mode, script, work_dir):
+    flags = ["--jit"] if mode.startswith("jit") else []
+    if mode in ("interp", "jit"):
+        return run_lox(binary, flags + ["--no-cache", script])
+    if mode in ("loxc", "jit-loxc"):
+        copy = os.path.join(work_dir, os.path.basename(script))
+        shutil.copy(script, copy)
+        status, _, stderr = run_lox(binary, ["--compile", copy])
+        if status != 0:
+            return status, "", "--compile failed:\n" + stderr
+        return run_lox(binary, flags + [os.path.splitext(copy)[0] + ".loxc"])
+    if mode == "cache":
+        cache_dir = tempfile.mkdtemp(dir=work_dir)
+        env = {"LOX_CACHE_DIR": cache_dir}
+        miss = run_lox(binary, [script], env)
+        entries = os.listdir(cache_dir)
+        if len(entries) != 1:
+            return miss[0], miss[1], miss[2] + "cache holds %s after the first run\n" % entries
+        hit = run_lox(binary, [script], env)
+        return miss if miss != hit else hit
+    raise ValueError(mode)
+
+
+def read_expected(script, suffix):
+    path = os.path.splitext(script)[0] + suffix
+    if not os.path.exists(path):
+        return ""
+    with open(path) as fp:
+        return fp.read()
+
+
+def diff(expected, actual, label, names=("expected", "actual")):
+    return "".join(difflib.unified_diff(expected.splitlines(True), actual.splitlines(True),
+                                        names[0] + " " + label, names[1] + " " + label))
+
+
+def run_scripts(binary, scripts, modes, work_dir):
+    failures = []
+    for script in scripts:
+        name = os.path.relpath(script, TESTS_DIR)
+        expected_out = read_expected(script, ".out")
+        expected_err = read_expected(script, ".err")
+        results = {}
+        for mode in modes:
+            status, stdout, stderr = results[mode] = run_mode(binary, mode, script, work_dir)
+            problems = []
+            if crashed(status, stderr):
+                problems.append("crashed (status %d)" % status)
+            if stdout != expected_out:
+                problems.append(diff(expected_out, stdout, "stdout"))
+            if stderr != expected_err:
+                problems.append(diff(expected_err, stderr, "stderr"))
+            if mode.startswith("jit"):
+                # The machine code must behave exactly like the interpreter it replaces.
+                base = mode[4:] or "interp"
+                if base not in results:
+                    results[base] = run_mode(binary, base, script, work_dir)
+                _, plain_out, plain_err = results[base]
+                names = ("without --jit", "with --jit")
+                if stdout != plain_out:
+                    problems.append(diff(plain_out, stdout, "stdout", names))
+                if stderr != plain_err:
+                    problems.append(diff(plain_err, stderr, "stderr", names))
+            print("%-4s %-36s %s" % ("FAIL" if problems else "ok", name, mode))
+            if problems:
+                failures.append((name, mode, "\n".join(problems)))
+    return failures
+
+
+def read_opcodes():
+    # The enum in op_code.h numbers the opcodes in order.
+    with open(os.path.join(ROOT_DIR, "op_code.h")) as fp:
+        text = fp.read()
+    body = text[text.index("{"):text.index("}")]
+    names = re.findall(r"^\s*(OP_\w+)\s*,", body, re.M)
+    return {name: i for i, name in enumerate(names)}
+
+
+def read_version():
+    with open(os.path.join(ROOT_DIR, "serialize.h")) as fp:
+        return int(re.search(r"#define LOXC_VERSION\s+\((\d+)\)", fp.read()).group(1))
+
+
+OP = read_opcodes()
+VERSION = read_version()
+
+
+class Function:
+    """A function as the .loxc format stores it. code is a list of opcode
+    names and operand bytes; constants are floats, strs, None, bools or
+    nested Functions."""
+
+    def __init__(self, code, constants=(), arity=0, upvalues=0, name=None, caches=0, lines=None):
+        self.code = bytes(OP[c] if isinstance(c, str) else c for c in code)
+        self.constants = list(constants)
+        self.arity = arity
+        self.upvalues = upvalues
+        self.name = name
+        self.caches = caches
+        self.lines = lines if lines is not None else [(0, 1)]
+
+
+class Writer:
+    """Writes .loxc files field by field, so that tests can also write
+    invalid ones."""
+
+    def __init__(self):
+        self.data = bytearray()
+
+    def u32(self, value):
+        self.data += struct.pack("<I", value)
+
+    def string(self, text, length=None, terminator=b"\0"):
+        raw = text.encode()
+        self.u32(len(raw) if length is None else length)
+        self.data += raw + terminator
+
+    def header(self, globals_=(), version=VERSION, magic=b"LOXC"):
+        self.data += magic
+        self.u32(version)
+        self.u32(len(globals_))
+        for name in globals_:
+            self.string(name)
+
+    def function(self, function):
+        self.u32(function.arity)
+        self.u32(function.upvalues)
+        self.data.append(function.name is not None)
+        if function.name is not None:
+            self.string(function.name)
+        self.u32(len(function.constants))
+        for value in function.constants:
+            if isinstance(value, Function):
+                self.data += b"F"
+                self.function(value)
+            elif isinstance(value, str):
+                self.data += b"S"
+                self.string(value)
+            elif isinstance(value, bool):
+                self.data += b"t" if value else b"f"
+            elif value is None:
+                self.data += b"n"
+            elif isinstance(value, bytes):
+                self.data += value
+            else:
+                self.data += b"N" + struct.pack("<d", value)
+        self.u32(len(function.code))
+        self.data += function.code
+        self.u32(len(function.lines))
+        while len(self.data) % 4 != 0:
+            self.data.append(0)
+        for offset, line in function.lines:
+            self.u32(offset)
+            self.u32(line)
+        self.u32(function.caches)
+
+
+def image(script, globals_=(), version=VERSION):
+    writer = Writer()
+    writer.header(globals_, version)
+    writer.function(script)
+    return bytes(writer.data)
+
+
+# print "ok"; the valid file every corrupted case below starts from
+HELLO = ["OP_CONSTANT", 0, "OP_PRINT", "OP_NIL", "OP_RETURN"]
+
+
+def nested(depth):
+    function = Function(["OP_NIL", "OP_RETURN"])
+    for _ in range(depth):
+        function = Function(["OP_NIL", "OP_RETURN"], [function])
+    return function
+
+
+def corrupted_images():
+    """(name, bytes) pairs the loader must reject."""
+    script = Function(HELLO, ["ok"])
+    cases = [
+        ("version mismatch (newer)", image(script, version=VERSION + 1)),
+        ("version mismatch (older)", image(script, version=VERSION - 1)),
+        ("trailing bytes", image(script) + b"\0"),
+        ("unknown opcode", image(Function([255, "OP_NIL", "OP_RETURN"]))),
+        ("quickened opcode", image(Function(["OP_CONSTANT", 0, "OP_CONSTANT", 0, "OP_ADD_NUM", "OP_RETURN"], [1.0]))),
+        ("no final return", image(Function(["OP_NIL", "OP_PRINT"]))),
+        ("empty code", image(Function([], lines=[]))),
+        ("more line entries than bytes", image(Function(["OP_RETURN"], lines=[(0, 1), (0, 2)]))),
+        ("constant out of range", image(Function(["OP_CONSTANT", 1, "OP_PRINT", "OP_NIL", "OP_RETURN"], ["ok"]))),
+        ("name constant is not a string", image(Function(["OP_CLASS", 0, "OP_POP", "OP_NIL", "OP_RETURN"], [1.0]))),
+        ("closure of a non-function", image(Function(["OP_CLOSURE", 0, "OP_POP", "OP_NIL", "OP_RETURN"], ["ok"]))),
+        ("closure captures a missing upvalue", image(Function(
+            ["OP_CLOSURE", 0, 0, 0, "OP_POP", "OP_NIL", "OP_RETURN"],
+            [Function(["OP_NIL", "OP_RETURN"], upvalues=1, name="f")]))),
+        ("upvalue out of range", image(Function(
+            ["OP_CLOSURE", 0, "OP_POP", "OP_NIL", "OP_RETURN"],
+            [Function(["OP_GET_UPVALUE", 0, "OP_RETURN"], name="f")]))),
+        ("global slot out of range", image(Function(["OP_GET_GLOBAL", 0, 1, "OP_PRINT", "OP_NIL", "OP_RETURN"]), ["a"])),
+        ("inline cache out of range", image(Function(
+            ["OP_NIL", "OP_GET_PROPERTY", 0, 0, 0, "OP_PRINT", "OP_NIL", "OP_RETURN"], ["x"]))),
+        ("jump past the end", image(Function(["OP_JUMP", 0, 9, "OP_NIL", "OP_RETURN"]))),
+        ("jump into an operand", image(Function(["OP_JUMP", 0, 1, "OP_CONSTANT", 0, "OP_RETURN"], [1.0]))),
+        ("loop before the start", image(Function(["OP_NIL", "OP_LOOP", 0, 9, "OP_RETURN"]))),
+        ("operand cut off by the end", image(Function(["OP_NIL", "OP_RETURN", "OP_CONSTANT"], [1.0]))),
+        ("top-level function takes arguments", image(Function(["OP_NIL", "OP_RETURN"], arity=1))),
+        ("functions nested too deep", image(nested(300))),
+        ("unknown constant tag", image(Function(["OP_NIL", "OP_RETURN"], [b"x"]))),
+    ]
+    writer = Writer()
+    writer.header()
+    writer.u32(0)
+    writer.u32(0)
+    writer.data.append(0)
+    writer.u32(0xffffffff)
+    writer.data += b"S"
+    writer.string("x")
+    cases.append(("huge constant count", bytes(writer.data)))
+    writer = Writer()
+    writer.header()
+    writer.u32(0)
+    writer.u32(0)
+    writer.data.append(1)
+    writer.string("f", terminator=b"x")
+    cases.append(("string without terminator", bytes(writer.data)))
+    writer = Writer()
+    writer.header()
+    writer.u32(0)
+    writer.u32(0)
+    writer.data.append(1)
+    writer.string("f", length=0x7fffffff)
+    cases.append(("string longer than the file", bytes(writer.data)))
+    return cases
+
+
+def check_rejected(binary, path):
+    status, stdout, stderr = run_lox(binary, [path])
+    if crashed(status, stderr):
+        return "crashed (status %d):\n%s" % (status, stderr[-2000:])
+    if REJECTED not in stderr or stdout != "compile error!\n":
+        return "was not rejected:\nstdout: %s\nstderr: %s" % (stdout, stderr)
+    return None
+
+
+def run_loader(binary, scripts, work_dir):
+    failures = []
+    path = os.path.join(work_dir, "case.loxc")
+
+    with open(path, "wb") as fp:
+        fp.write(image(Function(HELLO, ["ok"])))
+    status, stdout, stderr = run_lox(binary, [path])
+    valid = stdout == "ok\n" and stderr == ""
+    print("%-4s %-36s %s" % ("ok" if valid else "FAIL", "loader", "hand-written file"))
+    if not valid:
+        failures.append(("loader", "hand-written file", "stdout: %s\nstderr: %s" % (stdout, stderr)))
+        return failures
+
+    for name, data in corrupted_images():
+        with open(path, "wb") as fp:
+            fp.write(data)
+        problem = check_rejected(binary, path)
+        print("%-4s %-36s %s" % ("FAIL" if problem else "ok", "loader", name))
+        if problem:
+            failures.append(("loader", name, problem))
+
+    # Every prefix of a real compiled script, from the bare magic up.
+    for script in scripts:
+        copy = os.path.join(work_dir, os.path.basename(script))
+        shutil.copy(script, copy)
+        if run_lox(binary, ["--compile", copy])[0] != 0:
+            continue
+        with open(os.path.splitext(copy)[0] + ".loxc", "rb") as fp:
+            data = fp.read()
+        problems = []
+        for length in range(4, len(data)):
+            with open(path, "wb") as fp:
+                fp.write(data[:length])
+            problem = check_rejected(binary, path)
+            if problem:
+                problems.append("cut at %d bytes: %s" % (length, problem))
+        name = "truncated " + os.path.relpath(script, TESTS_DIR)
+        print("%-4s %-36s %s" % ("FAIL" if problems else "ok", "loader", name))
+        if problems:
+            failures.append(("loader", name, "\n".join(problems[:5])))
+    return failures
+
+
+def cache_entries(cache_dir):
+    return sorted(os.listdir(cache_dir)) if os.path.isdir(cache_dir) else []
+
+
+def check_output(result, expected_out, expected_err):
+    status, stdout, stderr = result
+    if crashed(status, stderr):
+        return "crashed (status %d):\n%s" % (status, stderr[-2000:])
+    if stdout != expected_out:
+        return diff(expected_out, stdout, "stdout")
+    if stderr != expected_err:
+        return diff(expected_err, stderr, "stderr")
+    return None
+
+
+def run_cache(binary, script, work_dir):
+    """Whatever is in the cache, a run prints the same as compiling the source.
+    script must run to the end without errors."""
+    failures = []
+    expected_out = read_expected(script, ".out")
+    expected_err = read_expected(script, ".err")
+
+    def report(name, problem):
+        print("%-4s %-36s %s" % ("FAIL" if problem else "ok", "cache", name))
+        if problem:
+            failures.append(("cache", name, problem))
+
+    cache_dir = os.path.join(work_dir, "cache")
+    env = {"LOX_CACHE_DIR": cache_dir}
+    problem = check_output(run_lox(binary, [script], env), expected_out, expected_err)
+    entries = cache_entries(cache_dir)
+    if problem is None and len(entries) != 1:
+        problem = "expected one cache file, found %s" % entries
+    report("first run writes the cache", problem)
+    if problem:
+        return failures
+    entry = os.path.join(cache_dir, entries[0])
+    with open(entry, "rb") as fp:
+        good = fp.read()
+
+    version = bytearray(good)
+    version[4:8] = struct.pack("<I", VERSION + 1)
+    corruptions = [
+        ("empty", b""),
+        ("truncated", good[:len(good) // 2]),
+        ("version mismatch", bytes(version)),
+        ("not bytecode", b"print 1;\n"),
+        ("unknown opcode", image(Function([255, "OP_NIL", "OP_RETURN"]))),
+    ]
+    for name, data in corruptions:
+        with open(entry, "wb") as fp:
+            fp.write(data)
+        problem = check_output(run_lox(binary, [script], env), expected_out, expected_err)
+        if problem is None:
+            with open(entry, "rb") as fp:
+                if fp.read() != good:
+                    problem = "the broken entry was not rewritten"
+        report("%s entry is recompiled" % name, problem)
+
+    edited = os.path.join(work_dir, "edited.lox")
+    with open(script) as fp:
+        source = fp.read()
+    with open(edited, "w") as fp:
+        fp.write(source + "print \"edited\";\n")
+    shutil.copy(script, os.path.join(work_dir, "same.lox"))
+    problem = check_output(run_lox(binary, [edited], env), expected_out + "edited\n", expected_err)
+    problem = problem or check_output(run_lox(binary, [os.path.join(work_dir, "same.lox")], env),
+                                      expected_out, expected_err)
+    if problem is None and len(cache_entries(cache_dir)) != 2:
+        problem = "expected two cache files, found %s" % cache_entries(cache_dir)
+    report("edited source gets its own entry", problem)
+
+    shared = os.path.join(work_dir, "shared")
+    procs = [subprocess.Popen([binary, script], stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True,
+                              env=dict(os.environ, ASAN_OPTIONS="detect_leaks=0", LOX_CACHE_DIR=shared))
+             for _ in range(8)]
+    problem = None
+    for proc in procs:
+        stdout, stderr = proc.communicate()
+        stdout = "".join(l for l in stdout.splitlines(True) if not l.startswith("======== run:"))
+        problem = problem or check_output((proc.returncode, stdout, stderr), expected_out, expected_err)
+    if problem is None and len(cache_entries(shared)) != 1:
+        problem = "expected one cache file and no temporaries, found %s" % cache_entries(shared)
+    report("concurrent first runs share one entry", problem)
+
+    blocked = os.path.join(work_dir, "blocked")
+    with open(blocked, "w") as fp:
+        fp.write("not a directory\n")
+    report("unwritable cache directory",
+           check_output(run_lox(binary, [script], {"LOX_CACHE_DIR": os.path.join(blocked, "lox")}),
+                        expected_out, expected_err))
+
+    unused = os.path.join(work_dir, "unused")
+    problem = check_output(run_lox(binary, ["--no-cache", script], {"LOX_CACHE_DIR": unused}),
+                           expected_out, expected_err)
+    if problem is None and cache_entries(unused):
+        problem = "--no-cache wrote %s" % cache_entries(unused)
+    report("--no-cache leaves the cache alone", problem)
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--lox", metavar="PATH", help="test an existing binary instead of building one")
+    parser.add_argument("--cflags", default="", help="extra CFLAGS for the built binary")
+    parser.add_argument("--filter", default="", help="only run scripts whose path contains this")
+    parser.add_argument("--mode", action="append", choices=MODES,
+                        help="only run scripts in this mode (repeatable, default: all)")
+    parser.add_argument("--no-loader", action="store_true", help="skip the corrupted .loxc and code cache checks")
+    args = parser.parse_args()
+
+    scripts = sorted(glob.glob(os.path.join(TESTS_DIR, "*", "*.lox")))
+    scripts = [s for s in scripts if args.filter in os.path.relpath(s, TESTS_DIR)]
+    if not scripts:
+        parser.error("no scripts match")
+
+    work_dir = tempfile.mkdtemp(prefix="loxtest-")
+    try:
+        binary = os.path.abspath(args.lox) if args.lox else build(args.cflags, work_dir)
+        failures = run_scripts(binary, scripts, args.mode or MODES, work_dir)
+        if not args.no_loader:
+            bytecode = [s for s in scripts if os.path.basename(os.path.dirname(s)) == "bytecode"]
+            failures += run_loader(binary, bytecode, work_dir)
+            clean = [s for s in bytecode if not read_expected(s, ".err")]
+            if clean:
+                failures += run_cache(binary, clean[0], work_dir)
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    for name, what, detail in failures:
+        print("\n==== %s (%s)\n%s" % (name, what, detail), file=sys.stderr)
+    print("%d failed" % len(failures), file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -15,6 +15,7 @@ bool is_values_equal(Value a, Value b)
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
         default: break;
     }
     return false;
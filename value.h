@@ -12,6 +12,7 @@
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
 
 typedef uint64_t Value;
 
@@ -20,6 +21,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -46,6 +48,7 @@ static inline double valueToNum(Value value) {
 
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -56,6 +59,7 @@ typedef enum {
     VAL_BOOL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 }ValueType;
 
 typedef struct {
@@ -73,11 +77,13 @@ typedef struct {
 #define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = (value)}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = (value)}})
 #define OBJ_VAL(value)      ((Value){VAL_OBJ, {.obj = (Obj *)(value)}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #define IS_NIL(value)       ((value).type == VAL_NIL)
 #define IS_BOOL(value)      ((value).type == VAL_BOOL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)      ((value).as.boolean)
 #define AS_NUMBER(value)    ((value).as.number)
@@ -113,6 +119,9 @@ typedef struct {
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 
+#define IS_FIBER(value)        is_obj_type(value, OBJ_FIBER)
+#define AS_FIBER(value)        ((struct ObjFiber*)AS_OBJ(value))
+
 
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
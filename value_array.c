@@ -9,20 +9,20 @@ void init_value_array(ValueArray *array)
     array->values = NULL;
 }
 
-void write_value_array(ValueArray *array, Value value)
+void write_value_array(VM *vm, ValueArray *array, Value value)
 {
     if (array->capacity < array->count+1) {
         int old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, old_capacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void free_value_array(ValueArray *array)
+void free_value_array(VM *vm, ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     init_value_array(array);
 }
 
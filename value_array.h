@@ -12,9 +12,9 @@ typedef struct {
 
 void init_value_array(ValueArray *array);
 
-void write_value_array(ValueArray *array, Value value);
+void write_value_array(VM *vm, ValueArray *array, Value value);
 
-void free_value_array(ValueArray *array);
+void free_value_array(VM *vm, ValueArray *array);
 
 #endif
 
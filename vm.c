@@ -4,145 +4,560 @@
 #include "debug.h"
 #include "memory.h"
 #include "obj_function.h"
+#include "jit.h"
+#include "obj_fiber.h"
+#include "serialize.h"
+#include "parallel_mark.h"
+#include "concurrent_mark.h"
 
-VM vm;
+#include <fcntl.h>
+#include <unistd.h>
 
-void push(Value value)
+void push(VM *vm, Value value)
 {
-    *vm.top = value;
-    vm.top++;
+    *vm->top = value;
+    vm->top++;
 }
 
-Value pop()
+Value pop(VM *vm)
 {
-    vm.top--;
-    return *vm.top;
+    vm->top--;
+    return *vm->top;
 }
 
-static Value peek(int pos)
+static Value peek(VM *vm, int pos)
 {
-    return vm.top[-1-pos];
+    return vm->top[-1-pos];
 }
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+int global_slot(VM *vm, ObjString *name)
+{
+    Value slot;
+    if (table_get(&vm->globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+    push(vm, OBJ_VAL(name));
+    write_value_array(vm, &vm->globalNames, OBJ_VAL(name));
+    write_value_array(vm, &vm->globalValues, UNDEFINED_VAL);
+    table_set(vm, &vm->globalSlots, name, NUMBER_VAL(vm->globalValues.count-1));
+    pop(vm);
+    return vm->globalValues.count-1;
 }
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static void defineNative(VM *vm, const char* name, NativeFn function) {
+  push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function)));
+  int slot = global_slot(vm, AS_STRING(vm->stack[0]));
+  vm->globalValues.values[slot] = vm->stack[1];
+  pop(vm);
+  pop(vm);
 }
 
-void init_vm()
-{
-    vm.frameCount = 0;
-    vm.top = vm.stack;
-    vm.objects = NULL;
-    vm.openUpvalues = NULL;
-    init_table(&vm.globals);
-    init_table(&vm.strings);
-    vm.initString = NULL;
-    vm.initString = copy_string("init", 4);
+static void runtime_error(VM *vm, const char* format, ...);
+static bool call(VM *vm, ObjClosure* closure, int argCount);
+
+static bool clockNative(VM* vm, int argCount, Value* args) {
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool fiberNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->function->arity > 1) {
+    runtime_error(vm, "Fiber body must be a function taking 0 or 1 arguments.");
+    return false;
+  }
+  args[-1] = OBJ_VAL(new_fiber(vm, AS_CLOSURE(args[0])));
+  return true;
+}
+
+// 切换fiber只是在VM和fiber之间交换栈指针, 不复制栈内容.
+// 新fiber从头调用, value是它的参数; 否则value作为它等待的结果
+static bool switchFiber(VM *vm, ObjFiber* to, Value value) {
+  fiber_save(vm, vm->fiber);
+  fiber_load(vm, to);
+  to->state = FIBER_RUNNING;
+  if (vm->frameCount > 0) {
+    push(vm, value);
+    return true;
+  }
+  int arity = to->closure->function->arity;
+  if (arity == 1) push(vm, value);
+  return call(vm, to->closure, arity);
+}
+
+// 当前fiber结束或等待时, 切到下一个可运行的fiber
+static bool scheduleNext(VM *vm) {
+  Value value;
+  ObjFiber* next = loop_next(vm, &value);
+  if (next != NULL) return switchFiber(vm, next, value);
+  if (vm->rootFiber->state != FIBER_WAITING) {
+    runtime_error(vm, "Deadlock: every fiber is waiting.");
+    return false;
+  }
+  // 主fiber在等其他fiber全部结束
+  fiber_save(vm, vm->fiber);
+  fiber_load(vm, vm->rootFiber);
+  vm->rootFiber->state = FIBER_RUNNING;
+  return true;
+}
+
+// 在native里挂起当前fiber, 下一个就绪的还是它时直接返回结果
+static bool suspendFiber(VM *vm, Value* args) {
+  ObjFiber* fiber = vm->fiber;
+  fiber->state = FIBER_WAITING;
+  Value value;
+  ObjFiber* next = loop_next(vm, &value);
+  if (next == fiber) {
+    fiber->state = FIBER_RUNNING;
+    args[-1] = value;
+    return true;
+  }
+  vm->top = args - 1;
+  if (next != NULL) return switchFiber(vm, next, value);
+  runtime_error(vm, "Deadlock: every fiber is waiting.");
+  return false;
+}
 
-      vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
-      vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+static bool resumeNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+    runtime_error(vm, "Can only resume a fiber.");
+    return false;
+  }
+  ObjFiber* fiber = AS_FIBER(args[0]);
+  if (fiber->state == FIBER_DONE) {
+    runtime_error(vm, "Cannot resume a finished fiber.");
+    return false;
+  }
+  if (fiber->state == FIBER_WAITING) {
+    runtime_error(vm, "Fiber is owned by the event loop.");
+    return false;
+  }
+  if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+    runtime_error(vm, "Fiber is already running.");
+    return false;
+  }
+  Value value = argCount == 2 ? args[1] : NIL_VAL;
+  vm->top = args - 1;
+  vm->fiber->state = FIBER_RESUMING;
+  SNAPSHOT_BARRIER(vm, fiber);
+  fiber->caller = vm->fiber;
+  WRITE_BARRIER_OBJ(vm, fiber, fiber->caller);
+  return switchFiber(vm, fiber, value);
+}
+
+static bool yieldNative(VM* vm, int argCount, Value* args) {
+  ObjFiber* fiber = vm->fiber;
+  if (fiber == vm->rootFiber) {
+    runtime_error(vm, "Cannot yield from the main fiber.");
+    return false;
+  }
+  if (fiber->caller == NULL) {
+    runtime_error(vm, "Cannot yield from a spawned fiber.");
+    return false;
+  }
+  if (argCount > 1) {
+    runtime_error(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+    return false;
+  }
+  Value value = argCount == 1 ? args[0] : NIL_VAL;
+  vm->top = args - 1;
+  ObjFiber* caller = fiber->caller;
+  SNAPSHOT_BARRIER(vm, fiber);
+  fiber->caller = NULL;
+  fiber->state = FIBER_SUSPENDED;
+  return switchFiber(vm, caller, value);
+}
+
+static bool isDoneNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FIBER(args[0])) {
+    runtime_error(vm, "Expected a fiber.");
+    return false;
+  }
+  args[-1] = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+  return true;
+}
 
-    defineNative("clock", clockNative);
+// fiber的函数返回后回到resume它的fiber, 返回值作为resume的结果.
+// spawn出来的fiber没有caller, 交给事件循环调度下一个
+static bool finishFiber(VM *vm, Value result) {
+  ObjFiber* fiber = vm->fiber;
+  ObjFiber* caller = fiber->caller;
+  SNAPSHOT_BARRIER(vm, fiber);
+  fiber->caller = NULL;
+  fiber->state = FIBER_DONE;
+  if (caller != NULL) {
+    if (!switchFiber(vm, caller, result)) return false;
+  } else if (!scheduleNext(vm)) {
+    return false;
+  }
+  // 切到新fiber时经过了safepoint, 可能开始了新一轮标记
+  SNAPSHOT_BARRIER(vm, fiber);
+  FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+  FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+  fiber->stack = NULL;
+  fiber->stackCapacity = 0;
+  fiber->top = NULL;
+  return true;
+}
+
+// 脚本返回时还有fiber没结束, 主fiber先等它们, 之后重新执行OP_RETURN
+static bool parkRoot(VM *vm) {
+  vm->rootFiber->state = FIBER_WAITING;
+  return scheduleNext(vm);
+}
+
+static bool spawnNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->function->arity > 1) {
+    runtime_error(vm, "Fiber body must be a function taking 0 or 1 arguments.");
+    return false;
+  }
+  ObjFiber* fiber = new_fiber(vm, AS_CLOSURE(args[0]));
+  args[-1] = OBJ_VAL(fiber);
+  loop_ready(vm, fiber, argCount == 2 ? args[1] : NIL_VAL);
+  return true;
+}
+
+static bool sleepNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_NUMBER(args[0])) {
+    runtime_error(vm, "Expected milliseconds to sleep.");
+    return false;
+  }
+  loop_sleep(vm, AS_NUMBER(args[0]), vm->fiber);
+  return suspendFiber(vm, args);
+}
+
+static bool openNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtime_error(vm, "Expected a path and a mode.");
+    return false;
+  }
+  const char* mode = AS_CSTRING(args[1]);
+  int flags;
+  if (strcmp(mode, "r") == 0) {
+    flags = O_RDONLY;
+  } else if (strcmp(mode, "w") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (strcmp(mode, "a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    runtime_error(vm, "Unknown open mode '%s'.", mode);
+    return false;
+  }
+  int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+  args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+  return true;
+}
+
+static bool closeNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_NUMBER(args[0])) {
+    runtime_error(vm, "Expected a file descriptor.");
+    return false;
+  }
+  int fd = (int)AS_NUMBER(args[0]);
+  loop_cancel_fd(vm, fd);
+  args[-1] = BOOL_VAL(close(fd) == 0);
+  return true;
+}
+
+static bool pipeNative(VM* vm, int argCount, Value* args) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    args[-1] = NIL_VAL;
+    return true;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  // 返回带reader和writer字段的Pipe实例
+  args[-1] = OBJ_VAL(copy_string(vm, "Pipe", 4));
+  ObjClass* klass = newClass(vm, AS_STRING(args[-1]));
+  args[-1] = OBJ_VAL(klass);
+  ObjInstance* instance = newInstance(vm, klass);
+  args[-1] = OBJ_VAL(instance);
+  const char* names[2] = {"reader", "writer"};
+  for (int i = 0; i < 2; i++) {
+    ObjString* name = copy_string(vm, names[i], 6);
+    push(vm, OBJ_VAL(name));
+    instanceSetShape(vm, instance, shapeTransition(vm, instance->shape, name));
+    instance->fields[i] = NUMBER_VAL(fds[i]);
+    pop(vm);
+  }
+  return true;
+}
+
+// 读写先直接尝试, 会阻塞时才登记到epoll并挂起当前fiber.
+// 普通文件永远不会阻塞, 所以总是同步完成
+static bool readNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_NUMBER(args[0]) ||
+      (argCount == 2 && !IS_NUMBER(args[1]))) {
+    runtime_error(vm, "Expected a file descriptor and an optional size.");
+    return false;
+  }
+  int fd = (int)AS_NUMBER(args[0]);
+  int size = argCount == 2 ? (int)AS_NUMBER(args[1]) : LOOP_READ_SIZE;
+  if (size <= 0) size = LOOP_READ_SIZE;
+  if (loop_try_read(vm, fd, size, &args[-1])) return true;
+  if (!loop_wait_read(vm, fd, size, vm->fiber)) {
+    runtime_error(vm, "Cannot wait to read file descriptor %d.", fd);
+    return false;
+  }
+  return suspendFiber(vm, args);
+}
+
+static bool writeNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_NUMBER(args[0]) || !IS_STRING(args[1])) {
+    runtime_error(vm, "Expected a file descriptor and a string.");
+    return false;
+  }
+  int fd = (int)AS_NUMBER(args[0]);
+  if (loop_try_write(vm, fd, args[1], &args[-1])) return true;
+  if (!loop_wait_write(vm, fd, args[1], vm->fiber)) {
+    runtime_error(vm, "Cannot wait to write file descriptor %d.", fd);
+    return false;
+  }
+  return suspendFiber(vm, args);
+}
+
+void init_vm(VM *vm)
+{
+    vm->frames = NULL;
+    vm->frameCount = 0;
+    vm->frameCapacity = 0;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->top = NULL;
+    vm->objects = NULL;
+    vm->young = NULL;
+    vm->unsweptOld = NULL;
+    vm->unsweptYoung = NULL;
+    vm->openUpvalues = NULL;
+    vm->initString = NULL;
+    vm->rootShape = NULL;
+    vm->compiler = NULL;
+    vm->fiber = NULL;
+    vm->rootFiber = NULL;
+    init_loop(&vm->loop);
+    vm->profiler = NULL;
+    vm->images = NULL;
+#ifdef DEBUG_OPCODE_STATS
+    vm->stats = new_op_stats();
+#endif
+    vm->jit = false;
+    vm->generational = true;
+    vm->out = stdout;
+    vm->err = stderr;
+    init_table(&vm->globalSlots);
+    init_value_array(&vm->globalNames);
+    init_value_array(&vm->globalValues);
+    init_table(&vm->strings);
+
+      vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+      vm->bytesAllocated = 0;
+  vm->nextGC = 1024 * 1024;
+  vm->peakBytes = 0;
+  vm->gcCount = 0;
+  vm->minorCount = 0;
+  vm->nurseryStart = 0;
+  vm->marking = false;
+  vm->sweeping = false;
+  vm->markEpoch = 1;
+  vm->gcPauseUs = GC_PAUSE_US;
+  vm->nextStep = 0;
+  vm->gcStartBytes = 0;
+  vm->maxPauseUs = 0;
+  vm->gcThreads = GC_THREADS;
+  vm->markPool = NULL;
+  vm->gcConcurrent = false;
+  vm->concurrentMarking = false;
+  vm->gcRequested = false;
+  vm->marker = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+
+    vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, 0, FRAMES_INIT);
+    vm->frameCapacity = FRAMES_INIT;
+    vm->stack = GROW_ARRAY(vm, Value, vm->stack, 0, STACK_INIT);
+    vm->stackCapacity = STACK_INIT;
+    vm->top = vm->stack;
+    vm->rootFiber = new_fiber(vm, NULL);
+    vm->rootFiber->state = FIBER_RUNNING;
+    vm->fiber = vm->rootFiber;
+
+    vm->initString = copy_string(vm, "init", 4);
+    vm->rootShape = newShape(vm, NULL, NULL);
+
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "fiber", fiberNative);
+    defineNative(vm, "resume", resumeNative);
+    defineNative(vm, "yield", yieldNative);
+    defineNative(vm, "isDone", isDoneNative);
+    defineNative(vm, "spawn", spawnNative);
+    defineNative(vm, "sleep", sleepNative);
+    defineNative(vm, "open", openNative);
+    defineNative(vm, "close", closeNative);
+    defineNative(vm, "pipe", pipeNative);
+    defineNative(vm, "read", readNative);
+    defineNative(vm, "write", writeNative);
 
 
 
 }
 
-void freeObject(Obj* object) {
+void freeObject(VM *vm, Obj* object) {
   #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
   switch (object->type) {
     case OBJ_STRING: {
-      free_string((ObjString*)object);
+      free_string(vm, (ObjString*)object);
       break;
     }
     case OBJ_FUNCTION: {
-        free_function((ObjFunction*)object);
+        free_function(vm, (ObjFunction*)object);
         break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE(vm, ObjNative, object);
       break;
       case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
+      FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues,
                  closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE(vm, ObjClosure, object);
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE(vm, ObjUpvalue, object);
       break;
 
       case OBJ_CLASS: {
         ObjClass* klass = (ObjClass*)object;
-      free_table(&klass->methods);
-      FREE(ObjClass, object);
+      free_table(vm, &klass->methods);
+      FREE(vm, ObjClass, object);
       break;
     }
 
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
-      free_table(&instance->fields);
-      FREE(ObjInstance, object);
+      FREE_ARRAY(vm, Value, instance->fields, instance->capacity);
+      FREE(vm, ObjInstance, object);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      free_table(vm, &shape->slots);
+      free_table(vm, &shape->transitions);
+      FREE(vm, ObjShape, object);
       break;
     }
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+      FREE(vm, ObjBoundMethod, object);
+      break;
+    case OBJ_FIBER:
+      free_fiber(vm, (ObjFiber*)object);
       break;
   }
 
 }
 
-void free_vm()
+void free_vm(VM *vm)
 {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    vm.initString = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    // 后台标记线程可能还在读对象
+    free_marker(vm->marker);
+    vm->marker = NULL;
+    vm->concurrentMarking = false;
+    free_table(vm, &vm->globalSlots);
+    free_value_array(vm, &vm->globalNames);
+    free_value_array(vm, &vm->globalValues);
+    free_table(vm, &vm->strings);
+    vm->initString = NULL;
+    vm->rootShape = NULL;
+    vm->fiber = NULL;
+    vm->rootFiber = NULL;
+    free_loop(vm, &vm->loop);
+#ifdef DEBUG_OPCODE_STATS
+    free_op_stats(vm->stats);
+    vm->stats = NULL;
+#endif
+    Obj* lists[] = {vm->young, vm->objects, vm->unsweptYoung, vm->unsweptOld};
+    for (int i=0; i<4; i++) {
+        Obj* object = lists[i];
+        while (object != NULL) {
+            Obj* next = object->next;
+            freeObject(vm, object);
+            object = next;
+        }
     }
-
-     free(vm.grayStack);
+    vm->young = NULL;
+    vm->objects = NULL;
+    vm->unsweptYoung = NULL;
+    vm->unsweptOld = NULL;
+    close_images(vm);
+
+    free_mark_pool(vm->markPool);
+    vm->markPool = NULL;
+     free(vm->grayStack);
+    free(vm->remembered);
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+    vm->frames = NULL;
+    vm->stack = NULL;
+    vm->top = NULL;
+    vm->frameCapacity = 0;
+    vm->stackCapacity = 0;
 }
 
-static void runtime_error(const char* format, ...)
+static void runtime_error(VM *vm, const char* format, ...)
 {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm->err, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fputs("\n", vm->err);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    // 栈很深时只打印两端
+    if (vm->frameCount > 32 && i == vm->frameCount - 17) {
+      fprintf(vm->err, "... %d more frames\n", vm->frameCount - 32);
+      i = 15;
+    }
+    CallFrame* frame = &vm->frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+    fprintf(vm->err, "[line %d] in ",
+            get_line(&function->chunk, (int)instruction));
     if (function->name == NULL) {
-      fprintf(stderr, "script\n");
+      fprintf(vm->err, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(vm->err, "%s()\n", function->name->chars);
+    }
+  }
+  // 出错的fiber, 所有等待它的fiber和事件循环里的fiber都结束, 回到主fiber
+  reset_loop(vm, &vm->loop);
+  if (vm->fiber != vm->rootFiber) {
+    fiber_save(vm, vm->fiber);
+    for (ObjFiber* fiber = vm->fiber; fiber != NULL && fiber != vm->rootFiber; ) {
+      ObjFiber* caller = fiber->caller;
+      SNAPSHOT_BARRIER(vm, fiber);
+      fiber->caller = NULL;
+      fiber->state = FIBER_DONE;
+      fiber = caller;
     }
+    fiber_load(vm, vm->rootFiber);
+    vm->rootFiber->state = FIBER_RUNNING;
   }
-  vm.top = vm.stack;
-  vm.openUpvalues = NULL;
-  vm.frameCount = 0;
+  vm->top = vm->stack;
+  vm->openUpvalues = NULL;
+  vm->frameCount = 0;
 }
 
 static bool isFalsey(Value value)
@@ -150,62 +565,107 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static void concatenate(VM *vm)
 {
-     ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
+     ObjString* b = AS_STRING(peek(vm, 0));
+  ObjString* a = AS_STRING(peek(vm, 1));
 
     int length = a->length + b->length;
-    char* chars = ALLOCATE_ARRAY(char, length + 1);
+    char* chars = ALLOCATE_ARRAY(vm, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString* result = take_string(chars, length);
-     pop();
-  pop();
+    ObjString* result = take_string(vm, chars, length);
+     pop(vm);
+  pop(vm);
+
+    push(vm, OBJ_VAL(result));
+}
+
+// 到阈值只尝试编译一次, 编译不了的函数不再计数(hotness不会溢出)
+static void jitCount(VM *vm, ObjFunction* function) {
+  if (vm->jit && function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD) {
+    jit_compile(vm, function);
+  }
+}
 
-    push(OBJ_VAL(result));
+// 栈重新分配后修正所有指向旧栈的指针
+static bool reserveStack(VM *vm, int count) {
+  int needed = (int)(vm->top - vm->stack) + count;
+  if (needed <= vm->stackCapacity) return true;
+  if (needed > STACK_MAX) return false;
+
+  int capacity = vm->stackCapacity;
+  while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+  if (capacity > STACK_MAX) capacity = STACK_MAX;
+  Value* old = vm->stack;
+  vm->stack = GROW_ARRAY(vm, Value, vm->stack, vm->stackCapacity, capacity);
+  vm->stackCapacity = capacity;
+  if (vm->stack == old) return true;
+
+  vm->top = vm->stack + (vm->top - old);
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old);
+  }
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = vm->stack + (upvalue->location - old);
+  }
+  return true;
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM *vm, ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
-    runtime_error("Expected %d arguments but got %d.",
+    runtime_error(vm, "Expected %d arguments but got %d.",
         closure->function->arity, argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
-    runtime_error("Stack overflow.");
+  if (vm->frameCount == vm->frameCapacity) {
+    if (vm->frameCapacity == FRAMES_MAX) {
+      runtime_error(vm, "Stack overflow.");
+      return false;
+    }
+    int capacity = GROW_CAPACITY(vm->frameCapacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+    PROFILE_PAUSE(vm);
+    vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity, capacity);
+    vm->frameCapacity = capacity;
+    PROFILE_RESUME(vm);
+  }
+  if (!reserveStack(vm, STACK_RESERVE)) {
+    runtime_error(vm, "Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  jitCount(vm, closure->function);
+  CallFrame* frame = &vm->frames[vm->frameCount];
   frame->closure  = closure ;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.top - argCount - 1;
+  frame->slots = vm->top - argCount - 1;
+  vm->frameCount++;
   return true;
 }
 
 
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM *vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_BOUND_METHOD: {
         ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-        vm.top[-argCount - 1] = bound->receiver;
-        return call(bound->method, argCount);
+        vm->top[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
-        vm.top[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        vm->top[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
         Value initializer;
-        if (table_get(&klass->methods, vm.initString,
+        if (table_get(&klass->methods, vm->initString,
                      &initializer)) {
-          return call(AS_CLOSURE(initializer), argCount);
+          return call(vm, AS_CLOSURE(initializer), argCount);
         }
         else if (argCount != 0) {
-          runtime_error("Expected 0 arguments but got %d.",
+          runtime_error(vm, "Expected 0 arguments but got %d.",
                        argCount);
           return false;
         }
@@ -214,24 +674,25 @@ static bool callValue(Value callee, int argCount) {
 
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.top - argCount);
-        vm.top -= argCount + 1;
-        push(result);
+        ObjFiber* fiber = vm->fiber;
+        if (!native(vm, argCount, vm->top - argCount)) return false;
+        // 切换了fiber的native已自己处理好栈
+        if (vm->fiber == fiber) vm->top -= argCount;
         return true;
       }
       case OBJ_CLOSURE:
-        return call(AS_CLOSURE(callee), argCount);
+        return call(vm, AS_CLOSURE(callee), argCount);
       default:
         break; // Non-callable object type.
     }
   }
-  runtime_error("Can only call functions and classes.");
+  runtime_error(vm, "Can only call functions and classes.");
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM *vm, Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
+  ObjUpvalue* upvalue = vm->openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
@@ -240,80 +701,590 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   if (upvalue != NULL && upvalue->location == local) {
     return upvalue;
   }
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
+  ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
   createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    vm->openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
   }
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL &&
-         vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
+static void closeUpvalues(VM *vm, Value* last) {
+  while (vm->openUpvalues != NULL &&
+         vm->openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->openUpvalues;
+    SNAPSHOT_BARRIER(vm, upvalue);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    WRITE_BARRIER(vm, upvalue, upvalue->closed);
+    vm->openUpvalues = upvalue->next;
   }
 }
 
-static void defineMethod(ObjString* name) {
-  Value method = peek(0);
-  ObjClass* klass = AS_CLASS(peek(1));
-  table_set(&klass->methods, name, method);
-  pop();
+// 用closure替换frame, 参数和接收者挪到frame的栈底
+static bool reuseFrame(VM *vm, CallFrame* frame, ObjClosure* closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtime_error(vm, "Expected %d arguments but got %d.",
+        closure->function->arity, argCount);
+    return false;
+  }
+
+  jitCount(vm, closure->function);
+  closeUpvalues(vm, frame->slots);
+  memmove(frame->slots, vm->top - argCount - 1, sizeof(Value) * (argCount + 1));
+  vm->top = frame->slots + argCount + 1;
+  if (!reserveStack(vm, STACK_RESERVE)) {
+    runtime_error(vm, "Stack overflow.");
+    return false;
+  }
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
+static bool tailCall(VM *vm, CallFrame* frame, int argCount) {
+  Value callee = peek(vm, argCount);
+  if (IS_CLOSURE(callee)) {
+    return reuseFrame(vm, frame, AS_CLOSURE(callee), argCount);
+  }
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm->top[-argCount - 1] = bound->receiver;
+    return reuseFrame(vm, frame, bound->method, argCount);
+  }
+  return callValue(vm, callee, argCount);
+}
+
+static void defineMethod(VM *vm, ObjString* name) {
+  Value method = peek(vm, 0);
+  ObjClass* klass = AS_CLASS(peek(vm, 1));
+  SNAPSHOT_BARRIER(vm, klass);
+  table_set(vm, &klass->methods, name, method);
+  WRITE_BARRIER(vm, klass, method);
+  klass->version++;
+  pop(vm);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+static CacheEntry* findCache(InlineCache* cache, ObjInstance* instance) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->shape == instance->shape &&
+        entry->klass == instance->klass &&
+        entry->version == instance->klass->version) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void updateCache(VM *vm, InlineCache* cache, ObjInstance* instance,
+                        ObjShape* transition, int index, Value method) {
+  // cache属于当前帧的函数
+  Obj* owner = (Obj*)vm->frames[vm->frameCount - 1].closure->function;
+  SNAPSHOT_BARRIER(vm, owner);
+  int i = 0;
+  while (i < INLINE_CACHE_WAYS - 1 &&
+         cache->entries[i].shape != NULL &&
+         (cache->entries[i].shape != instance->shape ||
+          cache->entries[i].klass != instance->klass)) {
+    i++;
+  }
+  for (; i > 0; i--) {
+    cache->entries[i] = cache->entries[i - 1];
+  }
+  cache->entries[0].klass = instance->klass;
+  cache->entries[0].version = instance->klass->version;
+  cache->entries[0].shape = instance->shape;
+  cache->entries[0].transition = transition;
+  cache->entries[0].index = index;
+  cache->entries[0].method = method;
+  WRITE_BARRIER_OBJ(vm, owner, instance->klass);
+  WRITE_BARRIER_OBJ(vm, owner, instance->shape);
+  WRITE_BARRIER_OBJ(vm, owner, transition);
+  WRITE_BARRIER(vm, owner, method);
+}
+
+static bool bindMethod(VM *vm, ObjClass* klass, ObjString* name) {
   Value method;
   if (!table_get(&klass->methods, name, &method)) {
-    runtime_error("Undefined property '%s'.", name->chars);
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
 
-  ObjBoundMethod* bound = newBoundMethod(peek(0),
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0),
                                          AS_CLOSURE(method));
-  pop();
-  push(OBJ_VAL(bound));
+  pop(vm);
+  push(vm, OBJ_VAL(bound));
   return true;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name,
-                            int argCount) {
+// tail不为NULL时是尾调用, 复用tail帧
+static bool invokeFromClass(VM *vm, ObjClass* klass, ObjString* name,
+                            int argCount, CallFrame* tail) {
   Value method;
   if (!table_get(&klass->methods, name, &method)) {
-    runtime_error("Undefined property '%s'.", name->chars);
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
-  return call(AS_CLOSURE(method), argCount);
+  if (tail != NULL) return reuseFrame(vm, tail, AS_CLOSURE(method), argCount);
+  return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-  Value receiver = peek(argCount);
+static bool invoke(VM *vm, ObjString* name, int argCount, InlineCache* cache,
+                   CallFrame* tail) {
+  Value receiver = peek(vm, argCount);
   if (!IS_INSTANCE(receiver)) {
-    runtime_error("Only instances have methods.");
+    runtime_error(vm, "Only instances have methods.");
     return false;
   }
 
   ObjInstance* instance = AS_INSTANCE(receiver);
 
-  Value value;
-  if (table_get(&instance->fields, name, &value)) {
-    vm.top[-argCount - 1] = value;
-    return callValue(value, argCount);
+  CacheEntry* entry = findCache(cache, instance);
+  if (entry != NULL && entry->index < 0) {
+    if (tail != NULL) return reuseFrame(vm, tail, AS_CLOSURE(entry->method), argCount);
+    return call(vm, AS_CLOSURE(entry->method), argCount);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    Value value = instance->fields[slot];
+    vm->top[-argCount - 1] = value;
+    if (tail != NULL) return tailCall(vm, tail, argCount);
+    return callValue(vm, value, argCount);
+  }
+
+  Value method;
+  if (!table_get(&instance->klass->methods, name, &method)) {
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+  updateCache(vm, cache, instance, NULL, -1, method);
+  if (tail != NULL) return reuseFrame(vm, tail, AS_CLOSURE(method), argCount);
+  return call(vm, AS_CLOSURE(method), argCount);
+}
+
+static bool getProperty(VM *vm, ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(vm, 0))) {
+    runtime_error(vm, "Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+  CacheEntry* entry = findCache(cache, instance);
+
+  Value method;
+  if (entry != NULL) {
+    if (entry->index >= 0) {
+      pop(vm); // Instance.
+      push(vm, instance->fields[entry->index]);
+      return true;
+    }
+    method = entry->method;
+  } else {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+      updateCache(vm, cache, instance, NULL, slot, NIL_VAL);
+      pop(vm); // Instance.
+      push(vm, instance->fields[slot]);
+      return true;
+    }
+    if (!table_get(&instance->klass->methods, name, &method)) {
+      runtime_error(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
+    updateCache(vm, cache, instance, NULL, -1, method);
   }
 
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+  pop(vm);
+  push(vm, OBJ_VAL(bound));
+  return true;
+}
+
+static bool setProperty(VM *vm, ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(vm, 1))) {
+    runtime_error(vm, "Only instances have fields.");
+    return false;
+  }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+  SNAPSHOT_BARRIER(vm, instance);
+  CacheEntry* entry = findCache(cache, instance);
+  if (entry != NULL) {
+    if (entry->transition != NULL) {
+      instanceSetShape(vm, instance, entry->transition);
+    }
+    instance->fields[entry->index] = peek(vm, 0);
+    WRITE_BARRIER(vm, instance, peek(vm, 0));
+  } else {
+    ObjShape* transition = NULL;
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) {
+      transition = shapeTransition(vm, instance->shape, name);
+      slot = transition->slotCount - 1;
+    }
+    updateCache(vm, cache, instance, transition, slot, NIL_VAL);
+    if (transition != NULL) {
+      instanceSetShape(vm, instance, transition);
+    }
+    instance->fields[slot] = peek(vm, 0);
+    WRITE_BARRIER(vm, instance, peek(vm, 0));
+  }
+  Value value = pop(vm);
+  pop(vm);
+  push(vm, value);
+  return true;
 }
 
-static InterpretResult run()
+#ifdef JIT_SUPPORTED
+// JIT生成的机器码按顺序调用这些函数, ip指向操作数
+#define JIT_CHUNK()         (&frame->closure->function->chunk)
+#define JIT_CONSTANT(i)     (JIT_CHUNK()->constants.values[(i)])
+#define JIT_SHORT(p)        ((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define JIT_CACHE(p)        (&JIT_CHUNK()->caches[JIT_SHORT(p)])
+#define JIT_BINARY_OP(name, type, op) \
+    static JitStatus jit_##name(VM* vm, CallFrame* frame, uint8_t* ip) { \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            frame->ip = ip; \
+            runtime_error(vm, "Operands must be numbers."); \
+            return JIT_ERROR; \
+        } \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, type(a op b)); \
+        return JIT_CONTINUE; \
+    }
+
+JIT_BINARY_OP(greater, BOOL_VAL, >)
+JIT_BINARY_OP(less, BOOL_VAL, <)
+JIT_BINARY_OP(subtract, NUMBER_VAL, -)
+JIT_BINARY_OP(multiply, NUMBER_VAL, *)
+JIT_BINARY_OP(divide, NUMBER_VAL, /)
+
+static JitStatus jit_constant(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, JIT_CONSTANT(ip[0]));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_nil(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, NIL_VAL);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_false(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, BOOL_VAL(false));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_true(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, BOOL_VAL(true));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_not(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, BOOL_VAL(isFalsey(pop(vm))));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_negate(VM* vm, CallFrame* frame, uint8_t* ip) {
+  if (!IS_NUMBER(peek(vm, 0))) {
+    frame->ip = ip;
+    runtime_error(vm, "Operand must be a number.");
+    return JIT_ERROR;
+  }
+  push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_equal(VM* vm, CallFrame* frame, uint8_t* ip) {
+  Value b = pop(vm);
+  Value a = pop(vm);
+  push(vm, BOOL_VAL(is_values_equal(a, b)));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_add(VM* vm, CallFrame* frame, uint8_t* ip) {
+  if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+    concatenate(vm);
+  } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+    double b = AS_NUMBER(pop(vm));
+    double a = AS_NUMBER(pop(vm));
+    push(vm, NUMBER_VAL(a + b));
+  } else {
+    frame->ip = ip;
+    runtime_error(vm, "Operands must be two numbers or two strings.");
+    return JIT_ERROR;
+  }
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_print(VM* vm, CallFrame* frame, uint8_t* ip) {
+  fprint_value(vm->out, pop(vm));
+  fputc('\n', vm->out);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_pop(VM* vm, CallFrame* frame, uint8_t* ip) {
+  pop(vm);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_define_global(VM* vm, CallFrame* frame, uint8_t* ip) {
+  vm->globalValues.values[JIT_SHORT(ip)] = pop(vm);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_get_global(VM* vm, CallFrame* frame, uint8_t* ip) {
+  uint16_t slot = JIT_SHORT(ip);
+  Value value = vm->globalValues.values[slot];
+  if (IS_UNDEFINED(value)) {
+    frame->ip = ip;
+    runtime_error(vm, "Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+    return JIT_ERROR;
+  }
+  push(vm, value);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_set_global(VM* vm, CallFrame* frame, uint8_t* ip) {
+  uint16_t slot = JIT_SHORT(ip);
+  if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+    frame->ip = ip;
+    runtime_error(vm, "Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+    return JIT_ERROR;
+  }
+  vm->globalValues.values[slot] = peek(vm, 0);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_get_local(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, frame->slots[ip[0]]);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_set_local(VM* vm, CallFrame* frame, uint8_t* ip) {
+  frame->slots[ip[0]] = peek(vm, 0);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_get_upvalue(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, *frame->closure->upvalues[ip[0]]->location);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_set_upvalue(VM* vm, CallFrame* frame, uint8_t* ip) {
+  ObjUpvalue* upvalue = frame->closure->upvalues[ip[0]];
+  SNAPSHOT_BARRIER(vm, upvalue);
+  *upvalue->location = peek(vm, 0);
+  WRITE_BARRIER(vm, upvalue, peek(vm, 0));
+  return JIT_CONTINUE;
+}
+
+// 返回非0表示跳转
+static JitStatus jit_jump_if_false(VM* vm, CallFrame* frame, uint8_t* ip) {
+  return isFalsey(peek(vm, 0)) ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_call(VM* vm, CallFrame* frame, uint8_t* ip) {
+  GC_SAFEPOINT(vm);
+  int frameCount = vm->frameCount;
+  ObjFiber* fiber = vm->fiber;
+  int argCount = ip[0];
+  frame->ip = ip + 1;
+  if (!callValue(vm, peek(vm, argCount), argCount)) return JIT_ERROR;
+  return vm->frameCount != frameCount || vm->fiber != fiber ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_tail_call(VM* vm, CallFrame* frame, uint8_t* ip) {
+  GC_SAFEPOINT(vm);
+  int frameCount = vm->frameCount;
+  ObjFiber* fiber = vm->fiber;
+  frame->ip = ip + 1;
+  if (!tailCall(vm, frame, ip[0])) return JIT_ERROR;
+  if (vm->fiber != fiber) return JIT_FRAME;
+  return vm->frameCount != frameCount || frame->ip != ip + 1 ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_closure(VM* vm, CallFrame* frame, uint8_t* ip) {
+  ObjFunction* function = AS_FUNCTION(JIT_CONSTANT(ip[0]));
+  ObjClosure* closure = newClosure(vm, function);
+  push(vm, OBJ_VAL(closure));
+  ip++;
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *ip++;
+    uint8_t index = *ip++;
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+    WRITE_BARRIER_OBJ(vm, closure, closure->upvalues[i]);
+  }
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_close_upvalue(VM* vm, CallFrame* frame, uint8_t* ip) {
+  closeUpvalues(vm, vm->top - 1);
+  pop(vm);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_class(VM* vm, CallFrame* frame, uint8_t* ip) {
+  push(vm, OBJ_VAL(newClass(vm, AS_STRING(JIT_CONSTANT(ip[0])))));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_get_property(VM* vm, CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip;
+  if (!getProperty(vm, AS_STRING(JIT_CONSTANT(ip[0])), JIT_CACHE(ip + 1))) return JIT_ERROR;
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_set_property(VM* vm, CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip;
+  if (!setProperty(vm, AS_STRING(JIT_CONSTANT(ip[0])), JIT_CACHE(ip + 1))) return JIT_ERROR;
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_method(VM* vm, CallFrame* frame, uint8_t* ip) {
+  defineMethod(vm, AS_STRING(JIT_CONSTANT(ip[0])));
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_invoke(VM* vm, CallFrame* frame, uint8_t* ip) {
+  GC_SAFEPOINT(vm);
+  int frameCount = vm->frameCount;
+  ObjFiber* fiber = vm->fiber;
+  frame->ip = ip + 4;
+  if (!invoke(vm, AS_STRING(JIT_CONSTANT(ip[0])), ip[1], JIT_CACHE(ip + 2), NULL)) return JIT_ERROR;
+  return vm->frameCount != frameCount || vm->fiber != fiber ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_tail_invoke(VM* vm, CallFrame* frame, uint8_t* ip) {
+  GC_SAFEPOINT(vm);
+  int frameCount = vm->frameCount;
+  ObjFiber* fiber = vm->fiber;
+  frame->ip = ip + 4;
+  if (!invoke(vm, AS_STRING(JIT_CONSTANT(ip[0])), ip[1], JIT_CACHE(ip + 2), frame)) return JIT_ERROR;
+  if (vm->fiber != fiber) return JIT_FRAME;
+  return vm->frameCount != frameCount || frame->ip != ip + 4 ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_inherit(VM* vm, CallFrame* frame, uint8_t* ip) {
+  Value superclass = peek(vm, 1);
+  if (!IS_CLASS(superclass)) {
+    frame->ip = ip;
+    runtime_error(vm, "Superclass must be a class.");
+    return JIT_ERROR;
+  }
+  ObjClass* subclass = AS_CLASS(peek(vm, 0));
+  SNAPSHOT_BARRIER(vm, subclass);
+  table_copy(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+  REMEMBER_OBJ(vm, subclass);
+  subclass->version++;
+  pop(vm);
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_get_super(VM* vm, CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip;
+  ObjClass* superclass = AS_CLASS(pop(vm));
+  if (!bindMethod(vm, superclass, AS_STRING(JIT_CONSTANT(ip[0])))) return JIT_ERROR;
+  return JIT_CONTINUE;
+}
+
+static JitStatus jit_super_invoke(VM* vm, CallFrame* frame, uint8_t* ip) {
+  int frameCount = vm->frameCount;
+  frame->ip = ip + 2;
+  ObjClass* superclass = AS_CLASS(pop(vm));
+  if (!invokeFromClass(vm, superclass, AS_STRING(JIT_CONSTANT(ip[0])), ip[1], NULL)) return JIT_ERROR;
+  return vm->frameCount != frameCount ? JIT_FRAME : JIT_CONTINUE;
+}
+
+static JitStatus jit_tail_super_invoke(VM* vm, CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip + 2;
+  ObjClass* superclass = AS_CLASS(pop(vm));
+  if (!invokeFromClass(vm, superclass, AS_STRING(JIT_CONSTANT(ip[0])), ip[1], frame)) return JIT_ERROR;
+  return JIT_FRAME;
+}
+
+static JitStatus jit_return(VM* vm, CallFrame* frame, uint8_t* ip) {
+  GC_SAFEPOINT(vm);
+  if (vm->frameCount == 1 && vm->fiber == vm->rootFiber && loop_busy(&vm->loop)) {
+    frame->ip = ip - 1;
+    return parkRoot(vm) ? JIT_FRAME : JIT_ERROR;
+  }
+  Value result = pop(vm);
+  closeUpvalues(vm, frame->slots);
+  vm->frameCount--;
+  if (vm->frameCount == 0) {
+    pop(vm);
+    if (vm->fiber == vm->rootFiber) return JIT_DONE;
+    return finishFiber(vm, result) ? JIT_FRAME : JIT_ERROR;
+  }
+  vm->top = frame->slots;
+  push(vm, result);
+  return JIT_FRAME;
+}
+
+JitHelper jit_helpers[UINT8_COUNT] = {
+    [OP_CONSTANT]       = jit_constant,
+    [OP_NIL]            = jit_nil,
+    [OP_FALSE]          = jit_false,
+    [OP_TRUE]           = jit_true,
+    [OP_NOT]            = jit_not,
+    [OP_NEGATE]         = jit_negate,
+    [OP_EQUAL]          = jit_equal,
+    [OP_GREATER]        = jit_greater,
+    [OP_LESS]           = jit_less,
+    [OP_ADD]            = jit_add,
+    [OP_SUBTRACT]       = jit_subtract,
+    [OP_MULTIPLY]       = jit_multiply,
+    [OP_DIVIDE]         = jit_divide,
+    [OP_PRINT]          = jit_print,
+    [OP_POP]            = jit_pop,
+    [OP_DEFINE_GLOBAL]  = jit_define_global,
+    [OP_GET_GLOBAL]     = jit_get_global,
+    [OP_SET_GLOBAL]     = jit_set_global,
+    [OP_GET_LOCAL]      = jit_get_local,
+    [OP_SET_LOCAL]      = jit_set_local,
+    [OP_GET_UPVALUE]    = jit_get_upvalue,
+    [OP_SET_UPVALUE]    = jit_set_upvalue,
+    [OP_JUMP_IF_FALSE]  = jit_jump_if_false,
+    [OP_CALL]           = jit_call,
+    [OP_TAIL_CALL]      = jit_tail_call,
+    [OP_CLOSURE]        = jit_closure,
+    [OP_CLOSE_UPVALUE]  = jit_close_upvalue,
+    [OP_CLASS]          = jit_class,
+    [OP_GET_PROPERTY]   = jit_get_property,
+    [OP_SET_PROPERTY]   = jit_set_property,
+    [OP_METHOD]         = jit_method,
+    [OP_INVOKE]         = jit_invoke,
+    [OP_INHERIT]        = jit_inherit,
+    [OP_GET_SUPER]      = jit_get_super,
+    [OP_SUPER_INVOKE]   = jit_super_invoke,
+    [OP_RETURN]         = jit_return,
+    [OP_TAIL_INVOKE]    = jit_tail_invoke,
+    [OP_TAIL_SUPER_INVOKE]          = jit_tail_super_invoke,
+};
+
+#undef JIT_BINARY_OP
+#undef JIT_CACHE
+#undef JIT_SHORT
+#undef JIT_CONSTANT
+#undef JIT_CHUNK
+#else
+JitHelper jit_helpers[UINT8_COUNT];
+#endif
+
+static InterpretResult run(VM *vm)
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    uint8_t instruction;
 
 #define READ_BYTE() (*frame->ip++)
 
@@ -325,324 +1296,556 @@ static InterpretResult run()
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING()       AS_STRING(READ_CONSTANT())
-#define BINARY_OP(type, op) do { \
-                                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                                    runtime_error("Operands must be numbers."); \
+#define READ_CACHE()        (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define ENTER_JIT()         do { \
+                                if (frame->closure->function->jit != NULL) goto enter_jit; \
+                            } while (0)
+// 映射的字节码是只读的, 不做quickening
+#define QUICKEN(op)         do { \
+                                if (!frame->closure->function->chunk.mapped) frame->ip[-1] = (op); \
+                            } while (0)
+#define DEQUICKEN(op)       do { \
+                                *--frame->ip = (op); \
+                                DISPATCH(); \
+                            } while (0)
+#define BINARY_OP(type, op, quick) do { \
+                                if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+                                    runtime_error(vm, "Operands must be numbers."); \
                                     return INTERPRET_RUNTIME_ERROR; \
                                 } \
-                                double b = AS_NUMBER(pop()); \
-                                double a = AS_NUMBER(pop()); \
-                                push(type(a op b)); \
+                                QUICKEN(quick); \
+                                double b = AS_NUMBER(pop(vm)); \
+                                double a = AS_NUMBER(pop(vm)); \
+                                push(vm, type(a op b)); \
+                            } while (0)
+#define BINARY_OP_NUM(type, op, generic) do { \
+                                Value b = vm->top[-1]; \
+                                Value a = vm->top[-2]; \
+                                if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEQUICKEN(generic); \
+                                vm->top--; \
+                                vm->top[-1] = type(AS_NUMBER(a) op AS_NUMBER(b)); \
                             } while (0)
 
-    while (1) {
-        #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot=vm.stack; slot<vm.top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-
-        disassembleInstruction(&frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
-
-        uint8_t instruction = READ_BYTE();
-        switch (instruction) {
-            case OP_CONSTANT:
-                {
-                    Value constant = READ_CONSTANT();
-                    push(constant);
-                }
-                break;
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() do { \
+                                printf("          "); \
+                                for (Value *slot=vm->stack; slot<vm->top; slot++) { \
+                                    printf("[ "); \
+                                    print_value(*slot); \
+                                    printf(" ]"); \
+                                } \
+                                printf("\n"); \
+                                disassembleInstruction(vm, &frame->closure->function->chunk, \
+                                    (int)(frame->ip - frame->closure->function->chunk.code)); \
+                            } while (0)
+#else
+#define TRACE_INSTRUCTION() do {} while (0)
+#endif
 
-            case OP_NIL:        push(NIL_VAL);                      break;
-            case OP_FALSE:      push(BOOL_VAL(false));              break;
-            case OP_TRUE:       push(BOOL_VAL(true));               break;
-            case OP_NOT:        push(BOOL_VAL(isFalsey(pop())));    break;
+#ifdef DEBUG_OPCODE_STATS
+#define COUNT_INSTRUCTION() count_op(vm->stats, instruction)
+#define PAUSE_STATS()       pause_op_stats(vm->stats)
+#else
+#define COUNT_INSTRUCTION() do {} while (0)
+#define PAUSE_STATS()       do {} while (0)
+#endif
 
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-
-            case OP_EQUAL:
-                {
-                    Value b = pop();
-                    Value a = pop();
-                    push(BOOL_VAL(is_values_equal(a, b)));
-                }
-                break;
-
-            case OP_GREATER:    BINARY_OP(BOOL_VAL, >);     break;
-            case OP_LESS:       BINARY_OP(BOOL_VAL, <);     break;
-
-            case OP_ADD:
-                {
-                    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                        concatenate();
-                    }
-                    else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                        double b = AS_NUMBER(pop());
-                        double a = AS_NUMBER(pop());
-                        push(NUMBER_VAL(a+b));
-                    }
-                    else {
-                        runtime_error("Operands must be two numbers or two strings.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                }
-                break;
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -);   break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *);   break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /);   break;
-
-            case OP_PRINT: {
-                print_value(pop());
-                printf("\n");
-                break;
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_MAX]   = &&do_unknown,
+        [OP_CONSTANT]       = &&do_OP_CONSTANT,
+        [OP_NIL]            = &&do_OP_NIL,
+        [OP_FALSE]          = &&do_OP_FALSE,
+        [OP_TRUE]           = &&do_OP_TRUE,
+        [OP_NOT]            = &&do_OP_NOT,
+        [OP_NEGATE]         = &&do_OP_NEGATE,
+        [OP_EQUAL]          = &&do_OP_EQUAL,
+        [OP_GREATER]        = &&do_OP_GREATER,
+        [OP_LESS]           = &&do_OP_LESS,
+        [OP_ADD]            = &&do_OP_ADD,
+        [OP_SUBTRACT]       = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY]       = &&do_OP_MULTIPLY,
+        [OP_DIVIDE]         = &&do_OP_DIVIDE,
+        [OP_PRINT]          = &&do_OP_PRINT,
+        [OP_POP]            = &&do_OP_POP,
+        [OP_DEFINE_GLOBAL]  = &&do_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]     = &&do_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]     = &&do_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]      = &&do_OP_GET_LOCAL,
+        [OP_SET_LOCAL]      = &&do_OP_SET_LOCAL,
+        [OP_GET_UPVALUE]    = &&do_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]    = &&do_OP_SET_UPVALUE,
+        [OP_JUMP]           = &&do_OP_JUMP,
+        [OP_JUMP_IF_FALSE]  = &&do_OP_JUMP_IF_FALSE,
+        [OP_LOOP]           = &&do_OP_LOOP,
+        [OP_CALL]           = &&do_OP_CALL,
+        [OP_TAIL_CALL]      = &&do_OP_TAIL_CALL,
+        [OP_CLOSURE]        = &&do_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]  = &&do_OP_CLOSE_UPVALUE,
+        [OP_CLASS]          = &&do_OP_CLASS,
+        [OP_GET_PROPERTY]   = &&do_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]   = &&do_OP_SET_PROPERTY,
+        [OP_METHOD]         = &&do_OP_METHOD,
+        [OP_INVOKE]         = &&do_OP_INVOKE,
+        [OP_INHERIT]        = &&do_OP_INHERIT,
+        [OP_GET_SUPER]      = &&do_OP_GET_SUPER,
+        [OP_SUPER_INVOKE]   = &&do_OP_SUPER_INVOKE,
+        [OP_RETURN]         = &&do_OP_RETURN,
+        [OP_TAIL_INVOKE]    = &&do_OP_TAIL_INVOKE,
+        [OP_TAIL_SUPER_INVOKE]          = &&do_OP_TAIL_SUPER_INVOKE,
+        [OP_ADD_LOCAL_LOCAL]            = &&do_OP_ADD_LOCAL_LOCAL,
+        [OP_LESS_LOCAL_CONSTANT_JUMP]   = &&do_OP_LESS_LOCAL_CONSTANT_JUMP,
+        [OP_GET_PROPERTY_SET_LOCAL]     = &&do_OP_GET_PROPERTY_SET_LOCAL,
+        [OP_ADD_NUM]        = &&do_OP_ADD_NUM,
+        [OP_ADD_STR]        = &&do_OP_ADD_STR,
+        [OP_SUBTRACT_NUM]   = &&do_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]   = &&do_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]     = &&do_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM]    = &&do_OP_GREATER_NUM,
+        [OP_LESS_NUM]       = &&do_OP_LESS_NUM,
+    };
+
+#define DISPATCH()          do { \
+                                TRACE_INSTRUCTION(); \
+                                instruction = READ_BYTE(); \
+                                COUNT_INSTRUCTION(); \
+                                goto *dispatch_table[instruction]; \
+                            } while (0)
+#define INTERPRET_LOOP      DISPATCH();
+#define CASE(op)            do_##op:
+#define DEFAULT             do_unknown:
+#else
+#define DISPATCH()          goto dispatch
+#define INTERPRET_LOOP      dispatch: \
+                            TRACE_INSTRUCTION(); \
+                            instruction = READ_BYTE(); \
+                            COUNT_INSTRUCTION(); \
+                            switch (instruction)
+#define CASE(op)            case op:
+#define DEFAULT             default:
+#endif
+
+enter_jit:
+    PAUSE_STATS();
+    while (frame->closure->function->jit != NULL) {
+        JitStatus status = jit_enter(frame);
+        if (status == JIT_NOT_ENTERED) break;
+        if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+        if (status == JIT_DONE) return INTERPRET_OK;
+        frame = &vm->frames[vm->frameCount - 1];
+    }
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT) {
+            Value constant = READ_CONSTANT();
+            push(vm, constant);
+            DISPATCH();
+        }
+
+        CASE(OP_NIL)        push(vm, NIL_VAL);                      DISPATCH();
+        CASE(OP_FALSE)      push(vm, BOOL_VAL(false));              DISPATCH();
+        CASE(OP_TRUE)       push(vm, BOOL_VAL(true));               DISPATCH();
+        CASE(OP_NOT)        push(vm, BOOL_VAL(isFalsey(pop(vm))));    DISPATCH();
+
+        CASE(OP_NEGATE) {
+            if (!IS_NUMBER(peek(vm, 0))) {
+                runtime_error(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+            DISPATCH();
+        }
 
-            case OP_POP: pop(); break;
+        CASE(OP_EQUAL) {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(is_values_equal(a, b)));
+            DISPATCH();
+        }
 
-            case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        table_set(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
+        CASE(OP_GREATER)    BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);     DISPATCH();
+        CASE(OP_LESS)       BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);        DISPATCH();
 
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!table_get(&vm.globals, name, &value)) {
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_ADD) {
+            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                QUICKEN(OP_ADD_STR);
+                concatenate(vm);
+            }
+            else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop(vm));
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a+b));
+            }
+            else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT)   BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);  DISPATCH();
+        CASE(OP_MULTIPLY)   BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);  DISPATCH();
+        CASE(OP_DIVIDE)     BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);    DISPATCH();
+
+        CASE(OP_ADD_NUM)        BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD);       DISPATCH();
+        CASE(OP_SUBTRACT_NUM)   BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT);  DISPATCH();
+        CASE(OP_MULTIPLY_NUM)   BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY);  DISPATCH();
+        CASE(OP_DIVIDE_NUM)     BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE);    DISPATCH();
+        CASE(OP_GREATER_NUM)    BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);     DISPATCH();
+        CASE(OP_LESS_NUM)       BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);        DISPATCH();
+
+        CASE(OP_ADD_STR) {
+            if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) DEQUICKEN(OP_ADD);
+            concatenate(vm);
+            DISPATCH();
         }
-        push(value);
-        break;
-      }
 
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (table_set(&vm.globals, name, peek(0))) {
-          table_del(&vm.globals, name);
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_PRINT) {
+            fprint_value(vm->out, pop(vm));
+            fputc('\n', vm->out);
+            DISPATCH();
         }
-        break;
-      }
 
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
+        CASE(OP_POP) pop(vm); DISPATCH();
 
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
+        CASE(OP_DEFINE_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            vm->globalValues.values[slot] = peek(vm, 0);
+            pop(vm);
+            DISPATCH();
+        }
 
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
+        CASE(OP_GET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error(vm, "Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(vm, value);
+            DISPATCH();
+        }
 
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
-      }
+        CASE(OP_SET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                runtime_error(vm, "Undefined variable '%s'.", AS_CSTRING(vm->globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm->globalValues.values[slot] = peek(vm, 0);
+            DISPATCH();
+        }
 
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
-      }
+        CASE(OP_GET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            push(vm, frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(vm, 0);
+            DISPATCH();
+        }
 
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
-      }
+        CASE(OP_GET_UPVALUE) {
+            uint8_t slot = READ_BYTE();
+            push(vm, *frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
 
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_SET_UPVALUE) {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            SNAPSHOT_BARRIER(vm, upvalue);
+            *upvalue->location = peek(vm, 0);
+            WRITE_BARRIER(vm, upvalue, peek(vm, 0));
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP) {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(vm, 0))) frame->ip += offset;
+            DISPATCH();
+        }
+
+        CASE(OP_LOOP) {
+            GC_SAFEPOINT(vm);
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+            jitCount(vm, frame->closure->function);
+            ENTER_JIT();
+            DISPATCH();
+        }
+
+        CASE(OP_CALL) {
+            GC_SAFEPOINT(vm);
+            int argCount = READ_BYTE();
+            if (!callValue(vm, peek(vm, argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
 
-            case OP_RETURN:
-                {
-
-                        Value result = pop();
-                        closeUpvalues(frame->slots);
-                        vm.frameCount--;
-                        if (vm.frameCount == 0) {
-                        pop();
-                        return INTERPRET_OK;
-                        }
-
-                        vm.top = frame->slots;
-                        push(result);
-                        frame = &vm.frames[vm.frameCount - 1];
-                        break;
+        CASE(OP_TAIL_CALL) {
+            GC_SAFEPOINT(vm);
+            int argCount = READ_BYTE();
+            if (!tailCall(vm, frame, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+
+        CASE(OP_RETURN) {
+            GC_SAFEPOINT(vm);
+            if (vm->frameCount == 1 && vm->fiber == vm->rootFiber && loop_busy(&vm->loop)) {
+                frame->ip--;
+                if (!parkRoot(vm)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frameCount - 1];
+                ENTER_JIT();
+                DISPATCH();
+            }
+            Value result = pop(vm);
+            closeUpvalues(vm, frame->slots);
+            vm->frameCount--;
+            if (vm->frameCount == 0) {
+                pop(vm);
+                if (vm->fiber == vm->rootFiber) return INTERPRET_OK;
+                if (!finishFiber(vm, result)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frameCount - 1];
+                ENTER_JIT();
+                DISPATCH();
+            }
+
+            vm->top = frame->slots;
+            push(vm, result);
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+
+        CASE(OP_CLOSURE) {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = newClosure(vm, function);
+            push(vm, OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] =
+                        captureUpvalue(vm, frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
-
-                case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] =
-                captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+                WRITE_BARRIER_OBJ(vm, closure, closure->upvalues[i]);
+            }
+            DISPATCH();
         }
-        break;
-      }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.top - 1);
-        pop();
-        break;
 
-        case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
+        CASE(OP_CLOSE_UPVALUE) {
+            closeUpvalues(vm, vm->top - 1);
+            pop(vm);
+            DISPATCH();
+        }
 
-        case OP_GET_PROPERTY: {
-          if (!IS_INSTANCE(peek(0))) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_CLASS) {
+            push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+            DISPATCH();
         }
 
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = READ_STRING();
+        CASE(OP_GET_PROPERTY) {
+            ObjString* name = READ_STRING();
+            if (!getProperty(vm, name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
 
-        Value value;
-        if (table_get(&instance->fields, name, &value)) {
-          pop(); // Instance.
-          push(value);
-          break;
+        CASE(OP_SET_PROPERTY) {
+            ObjString* name = READ_STRING();
+            if (!setProperty(vm, name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
         }
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+
+        CASE(OP_METHOD) {
+            defineMethod(vm, READ_STRING());
+            DISPATCH();
+        }
+
+        CASE(OP_INVOKE) {
+            GC_SAFEPOINT(vm);
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            if (!invoke(vm, method, argCount, READ_CACHE(), NULL)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
         }
-        break;
-      }
 
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtime_error("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_TAIL_INVOKE) {
+            GC_SAFEPOINT(vm);
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            if (!invoke(vm, method, argCount, READ_CACHE(), frame)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
         }
 
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        table_set(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
-      }
+        CASE(OP_INHERIT) {
+            Value superclass = peek(vm, 1);
+            if (!IS_CLASS(superclass)) {
+                runtime_error(vm, "Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjClass* subclass = AS_CLASS(peek(vm, 0));
+            SNAPSHOT_BARRIER(vm, subclass);
+            table_copy(vm, &AS_CLASS(superclass)->methods,
+                        &subclass->methods);
+            REMEMBER_OBJ(vm, subclass);
+            subclass->version++;
+            pop(vm); // Subclass.
+            DISPATCH();
+        }
 
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
+        CASE(OP_GET_SUPER) {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop(vm));
 
-        case OP_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
 
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtime_error("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_SUPER_INVOKE) {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            if (!invokeFromClass(vm, superclass, method, argCount, NULL)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ENTER_JIT();
+            DISPATCH();
         }
-        ObjClass* subclass = AS_CLASS(peek(0));
-        table_copy(&AS_CLASS(superclass)->methods,
-                    &subclass->methods);
-        pop(); // Subclass.
-        break;
-      }
 
-      case OP_GET_SUPER: {
-        ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop());
+        CASE(OP_TAIL_SUPER_INVOKE) {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            if (!invokeFromClass(vm, superclass, method, argCount, frame)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER_JIT();
+            DISPATCH();
+        }
 
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_ADD_LOCAL_LOCAL) {
+            Value a = frame->slots[frame->ip[0]];
+            Value b = frame->slots[frame->ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                frame->ip += 4;
+                DISPATCH();
+            }
+            push(vm, a);
+            push(vm, b);
+            frame->ip += 3;
+            DISPATCH();
         }
-        break;
-      }
 
-      case OP_SUPER_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP) {
+            Value a = frame->slots[frame->ip[0]];
+            Value b = frame->closure->function->chunk.constants.values[frame->ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                if (AS_NUMBER(a) < AS_NUMBER(b)) {
+                    frame->ip += 8;
+                }
+                else {
+                    uint16_t offset = (uint16_t)((frame->ip[5] << 8) | frame->ip[6]);
+                    push(vm, BOOL_VAL(false));
+                    frame->ip += 7 + offset;
+                }
+                DISPATCH();
+            }
+            push(vm, a);
+            push(vm, b);
+            frame->ip += 3;
+            DISPATCH();
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
 
-            default:
-                printf("Unknown instruction %d\n", instruction);
+        CASE(OP_GET_PROPERTY_SET_LOCAL) {
+            ObjString* name = READ_STRING();
+            if (!getProperty(vm, name, READ_CACHE())) {
                 return INTERPRET_RUNTIME_ERROR;
+            }
+            frame->ip++;
+            frame->slots[READ_BYTE()] = peek(vm, 0);
+            DISPATCH();
         }
+
+        DEFAULT
+            fprintf(vm->err, "Unknown instruction %d\n", instruction);
+            return INTERPRET_RUNTIME_ERROR;
     }
     return INTERPRET_OK;
 
+#undef DEFAULT
+#undef CASE
+#undef INTERPRET_LOOP
+#undef DISPATCH
+#undef PAUSE_STATS
+#undef COUNT_INSTRUCTION
+#undef TRACE_INSTRUCTION
+#undef BINARY_OP_NUM
 #undef BINARY_OP
+#undef DEQUICKEN
+#undef QUICKEN
+#undef ENTER_JIT
+#undef READ_CACHE
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_BYTE
 }
 
-InterpretResult interpret(const char *source)
+InterpretResult interpret(VM *vm, const char *source)
 {
-    ObjFunction *function = compile(source);
+    ObjFunction *function = compile(vm, source);
 
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
 
-    push(OBJ_VAL(function));
+    return interpret_function(vm, function);
+}
+
+InterpretResult interpret_function(VM *vm, ObjFunction *function)
+{
+    push(vm, OBJ_VAL(function));
 
-    ObjClosure* closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
+    ObjClosure* closure = newClosure(vm, function);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+  call(vm, closure, 0);
 
-    return run();
+    return run(vm);
 }
 
@@ -7,9 +7,20 @@
 #include "value.h"
 #include "table.h"
 #include "obj_function.h"
+#include "event_loop.h"
+#include "op_stats.h"
+#include "profiler.h"
 
-#define FRAMES_MAX          (64)
-#define STACK_MAX           (FRAMES_MAX * UINT8_COUNT)
+// 栈按需增长, 超过上限报Stack overflow.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX          (65536)
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX           (1024 * 1024)
+#endif
+#define FRAMES_INIT         (16)
+#define STACK_INIT          (1024)
+#define STACK_RESERVE       (UINT8_COUNT * 2)
 
 typedef struct {
     ObjClosure* closure;
@@ -17,16 +28,37 @@ typedef struct {
     Value *slots;
 }CallFrame;
 
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+struct VM {
+    CallFrame *frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    Value *stack;
+    int stackCapacity;
     Value *top;
-    Table globals;
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
     Table strings;
     Obj *objects;
+    Obj *young;
+    Obj *unsweptOld;    // full GC标记完还没清除的对象, 分配时一段一段清除
+    Obj *unsweptYoung;
     ObjUpvalue* openUpvalues;
     ObjString* initString;
+    ObjShape* rootShape;
+    struct Compiler* compiler;
+    struct ObjFiber* fiber;
+    struct ObjFiber* rootFiber;
+    EventLoop loop;
+    struct Profiler* profiler;
+    struct Image* images;
+#ifdef DEBUG_OPCODE_STATS
+    OpStats *stats;
+#endif
+    bool jit;
+    bool generational;
+    FILE *out;
+    FILE *err;
 
     int grayCount;
   int grayCapacity;
@@ -34,9 +66,29 @@ typedef struct {
 
   size_t bytesAllocated;
   size_t nextGC;
-
-
-}VM;
+  size_t peakBytes;
+  int gcCount;
+  int minorCount;
+  size_t nurseryStart;
+  bool marking;
+  bool sweeping;
+  uint8_t markEpoch;
+  int gcPauseUs;
+  size_t nextStep;
+  size_t gcStartBytes;
+  double maxPauseUs;
+  int gcThreads;
+  struct MarkPool* markPool;
+  bool gcConcurrent;
+  bool concurrentMarking;
+  bool gcRequested;
+  struct Marker* marker;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -44,19 +96,21 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 }InterpretResult;
 
-extern VM vm;
+void init_vm(VM *vm);
+
+void free_vm(VM *vm);
 
-void init_vm();
+InterpretResult interpret(VM *vm, const char *source);
 
-void free_vm();
+InterpretResult interpret_function(VM *vm, ObjFunction *function);
 
-InterpretResult interpret(const char *source);
+int global_slot(VM *vm, ObjString *name);
 
-void freeObject(Obj* object);
+void freeObject(VM *vm, Obj* object);
 
-void push(Value value);
+void push(VM *vm, Value value);
 
-Value pop();
+Value pop(VM *vm);
 
 #endif
 